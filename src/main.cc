@@ -3,16 +3,28 @@
 // Copyright (C)2012 Berke DURAK
 // Released under the GPL3 license
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <vector>
 #include <string>
 #include <map>
 #include <set>
-#include <forward_list>
 #include <vector>
 #include <stdexcept>
+#include <exception>
 #include <memory>
 #include <algorithm>
 #include <utility>
+#include <array>
+#include <limits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 
 #include <cstdio>
 #include <cstdlib>
@@ -25,11 +37,28 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <signal.h>
+#include <setjmp.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
@@ -94,66 +123,331 @@ public:
 	}
 };
 
+// Strings are packed into slabs that are never moved, so that the pool
+// can grow without copying.  Slabs double in size up to max_slab, which
+// keeps small pools small.  With Huge set, full-size slabs are mapped
+// separately and aligned so that they can be backed by huge pages.
+//
+// Handles are 48-bit (slab, offset) pairs stored as three 16-bit words,
+// so that they take six bytes.
 class string_pool : non_copyable {
-	vector<char> pool;
+	enum {
+		offset_bits = 21,
+		min_slab = 64,
+		max_slab = 1 << offset_bits
+	};
+
+	struct slab {
+		char *base;
+		size_t size;
+		bool mapped;
+	};
+
+	vector<slab> slabs;
+	size_t used;
 	size_t count;
+	bool huge;
+
+	static char *map_aligned(size_t n) {
+		size_t m = 2 * n;
+		void *p = mmap(NULL, m, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return NULL;
+
+		char *q = reinterpret_cast<char *>(p);
+		char *r = reinterpret_cast<char *>(
+				(reinterpret_cast<uintptr_t>(q) + n - 1) &
+				~uintptr_t(n - 1));
+		if (r > q) munmap(q, r - q);
+		munmap(r + n, q + m - (r + n));
+		madvise(r, n, MADV_HUGEPAGE);
+		return r;
+	}
+
+	void add_slab(size_t m) {
+		slab sl;
+
+		if (m > max_slab)
+			throw runtime_error("String too long for pool");
+
+		sl.size = slabs.empty() ? size_t(min_slab) :
+			min(2 * slabs.back().size, size_t(max_slab));
+		sl.size = max(sl.size, m);
+		sl.base = NULL;
+		sl.mapped = huge && sl.size == max_slab;
+		if (sl.mapped)
+			sl.base = map_aligned(sl.size);
+		if (sl.base == NULL) {
+			sl.mapped = false;
+			sl.base = new char[sl.size];
+		}
+		slabs.push_back(sl);
+		used = 0;
+	}
 
 public:
 	class handle {
-		unsigned offset;
+		uint16_t w[3];
 		friend class string_pool;
+
+		void set(uint64_t u) {
+			w[0] = u;
+			w[1] = u >> 16;
+			w[2] = u >> 32;
+		}
+
+		uint64_t get() const {
+			return w[0] | uint64_t(w[1]) << 16 |
+				uint64_t(w[2]) << 32;
+		}
 	};
 
-	string_pool() : count(0) { }
+	string_pool(bool Huge=false) : used(0), count(0), huge(Huge) { }
+
+	~string_pool() {
+		for (auto &sl: slabs) {
+			if (sl.mapped)
+				munmap(sl.base, sl.size);
+			else
+				delete[] sl.base;
+		}
+	}
 
 	handle add(const char *u) {
-		size_t m = strlen(u);
-		unsigned i = pool.size();
-		size_t n = pool.capacity();
-		count ++;
-		if (n < i + m + 1) {
-			if (!n) n = 1;
-			while (n < i + m + 1)
-				n <<= 1;
-			pool.reserve(n);
-		}
-		pool.resize(i + m + 1);
-		memcpy(&pool[i], u, m + 1);
+		size_t m = strlen(u) + 1;
+
+		if (slabs.empty() || used + m > slabs.back().size)
+			add_slab(m);
+
+		memcpy(slabs.back().base + used, u, m);
 		handle h;
-		h.offset = i;
+		h.set((uint64_t(slabs.size() - 1) << offset_bits) | used);
+		used += m;
+		count ++;
 		return h;
 	}
 
 	const char *get(const handle &h) const {
-		return &pool[h.offset];
+		const uint64_t mask = (uint64_t(1) << offset_bits) - 1;
+		uint64_t u = h.get();
+		return slabs[u >> offset_bits].base + (u & mask);
+	}
+
+	size_t memory() const {
+		size_t n = slabs.capacity() * sizeof(slab);
+		for (auto &sl: slabs) n += sl.size;
+		return n;
 	}
 };
 
-struct file_info {
-	string_pool::handle name;
-	mode_t mode;
-	ino_t ino;
-	const file_info *parent;
-	
-	void clear() {
-		mode = 0;
-		parent = NULL;
+typedef uint32_t file_index;
+static const file_index no_file = 0xffffffff;
+
+// Files and directories, addressed by 32-bit indices into parallel
+// arrays.  Devices are numbered in the order they are met so that they
+// fit in 16 bits.
+class file_store : non_copyable {
+	deque<string_pool::handle> names;
+	deque<file_index> parents;
+	deque<uint16_t> modes;
+	deque<ino_t> inos;
+	deque<uint16_t> devs;
+	vector<dev_t> devices;
+
+public:
+	file_store() { }
+
+	uint16_t device_number(dev_t dev) {
+		for (size_t i = devices.size(); i > 0; i --)
+			if (devices[i - 1] == dev) return i - 1;
+		if (devices.size() > 0xffff)
+			throw runtime_error("Too many devices");
+		devices.push_back(dev);
+		return devices.size() - 1;
+	}
+
+	file_index add(const string_pool::handle &name, file_index parent,
+			dev_t dev, ino_t ino, mode_t mode)
+	{
+		if (names.size() >= no_file)
+			throw runtime_error("Too many files");
+
+		names.push_back(name);
+		parents.push_back(parent);
+		modes.push_back(mode);
+		inos.push_back(ino);
+		devs.push_back(device_number(dev));
+		return names.size() - 1;
+	}
+
+	size_t size() const { return names.size(); }
+	size_t device_count() const { return devices.size(); }
+	dev_t device(uint16_t d) const { return devices[d]; }
+
+	uint16_t dev(file_index i) const { return devs[i]; }
+	ino_t ino(file_index i) const { return inos[i]; }
+	mode_t mode(file_index i) const { return modes[i]; }
+	file_index parent(file_index i) const { return parents[i]; }
+	const string_pool::handle &name(file_index i) const {
+		return names[i];
+	}
+
+	size_t memory() const {
+		return size() * (sizeof(string_pool::handle) +
+				sizeof(file_index) + sizeof(uint16_t) +
+				sizeof(ino_t) + sizeof(uint16_t));
+	}
+};
+
+// Builds the full paths of files.  The paths of recently used
+// directories are kept in a direct-mapped cache, so that files in the
+// same directory, which are usually reported together, only cost the
+// concatenation of their own name.
+class path_builder : non_copyable {
+	enum { cache_size = 4096 };
+
+	struct entry {
+		file_index dir;
+		string path;
+	};
+
+	const file_store &nodes;
+	const string_pool &sp;
+	vector<entry> cache;
+
+	const string &dir_path(file_index d) {
+		entry &e = cache[d % cache_size];
+
+		if (e.dir != d) {
+			string u = get(d);
+			e.dir = d;
+			e.path.swap(u);
+		}
+		return e.path;
+	}
+
+public:
+	path_builder(const file_store &Nodes, const string_pool &Sp) :
+		nodes(Nodes),
+		sp(Sp),
+		cache(cache_size)
+	{
+		for (auto &e: cache) e.dir = no_file;
 	}
 
-	string get_path(const string_pool &sp) {
+	// Path of the entry basename of directory dir, or of basename
+	// itself if dir is no_file.
+	string get(file_index dir, const char *basename) {
 		path p;
 
-		make_path(sp, p, this);
+		if (dir != no_file) p.set(dir_path(dir).c_str());
+		p.push(basename);
 		return p.get();
 	}
 
+	string get(file_index i) {
+		return get(nodes.parent(i), sp.get(nodes.name(i)));
+	}
+};
+
+// Maps (dev, ino) to the first name met for that inode.  Open addressing
+// with linear probing keeps this to one flat array of file indices, the
+// keys themselves being read back from the file store; the rare
+// additional names of hard-linked files are kept aside, and sorted by
+// their first name when they are first looked up.
+class inode_index : non_copyable {
+	typedef pair<file_index, file_index> link;
+
+	struct by_first {
+		bool operator()(const link &a, const link &b) const {
+			return a.first < b.first;
+		}
+	};
+
+	const file_store &files;
+	vector<file_index> slots;
+	size_t used;
+	vector<link> links;
+	bool links_sorted;
+
+	static size_t hash(uint16_t dev, ino_t ino) {
+		uint64_t h = uint64_t(ino) * 0x9e3779b97f4a7c15ULL;
+		h ^= uint64_t(dev) + (h >> 29);
+		h *= 0xbf58476d1ce4e5b9ULL;
+		return h ^ (h >> 32);
+	}
+
+	file_index &find(uint16_t dev, ino_t ino) {
+		size_t mask = slots.size() - 1;
+		size_t i = hash(dev, ino) & mask;
+
+		while (slots[i] != no_file &&
+				(files.ino(slots[i]) != ino ||
+				 files.dev(slots[i]) != dev))
+			i = (i + 1) & mask;
+		return slots[i];
+	}
+
+	void grow() {
+		vector<file_index> old;
+
+		old.swap(slots);
+		slots.resize(max(2 * old.size(), size_t(1024)), no_file);
+		for (auto i: old) {
+			if (i != no_file)
+				find(files.dev(i), files.ino(i)) = i;
+		}
+	}
+
 public:
-	void make_path(const string_pool &sp, path& p, const file_info *up)
+	inode_index(const file_store &Files) :
+		files(Files),
+		used(0),
+		links_sorted(true)
 	{
-		if (up->parent != NULL) {
-			make_path(sp, p, up->parent);
-			p.push(sp.get(up->name));
+		grow();
+	}
+
+	// Registers file i, already in the store, as a name of its inode.
+	// Returns the first name already registered for that inode, or
+	// no_file if i is the first one.
+	file_index insert(file_index i) {
+		if (4 * (used + 1) > 3 * slots.size())
+			grow();
+
+		file_index &t = find(files.dev(i), files.ino(i));
+		if (t != no_file) {
+			links.push_back(link(t, i));
+			links_sorted = false;
+			return t;
 		}
+
+		t = i;
+		used ++;
+		return no_file;
+	}
+
+	// Returns all the names of the inode whose first name is first.
+	vector<file_index> names(file_index first) {
+		vector<file_index> v;
+
+		v.push_back(first);
+
+		if (!links_sorted) {
+			stable_sort(links.begin(), links.end(), by_first());
+			links_sorted = true;
+		}
+
+		auto r = equal_range(links.begin(), links.end(),
+				link(first, no_file), by_first());
+		for (auto it = r.first; it != r.second; it ++)
+			v.push_back(it->second);
+		return v;
+	}
+
+	size_t memory() const {
+		return slots.capacity() * sizeof(file_index) +
+			links.capacity() * sizeof(link);
 	}
 };
 
@@ -315,19 +609,37 @@ public:
 
 class unix_dir : non_copyable {
 	DIR *dir;
-public:
-	unix_dir(const char *path) {
-		dir = opendir(path);
-		if (dir == NULL)
+
+	void open(int at, const char *path) {
+		int fd = openat(at, path, O_RDONLY | O_DIRECTORY |
+				O_NOFOLLOW | O_CLOEXEC);
+		dir = fd < 0 ? NULL : fdopendir(fd);
+		if (dir == NULL) {
+			int e = errno;
+			if (fd >= 0) close(fd);
 			throw runtime_error(
 					string("Cannot open '") +
 					path +
 					string("': ") +
-					strerror(errno));
+					strerror(e));
+		}
+	}
+
+public:
+	unix_dir(const char *path) {
+		open(AT_FDCWD, path);
+	}
+	// Opens the directory named by path relative to the directory
+	// open on at.
+	unix_dir(int at, const char *path) {
+		open(at, path);
 	}
 	virtual ~unix_dir() {
 		unix_rc rc = closedir(dir);
 	}
+	int fd() const {
+		return dirfd(dir);
+	}
 	bool read(const struct dirent *&e) {
 		struct dirent *e_p = readdir(dir);
 		if (e_p != NULL) {
@@ -373,6 +685,27 @@ public:
 
 struct tickable {
 	virtual bool tick(uint64_t delta) = 0;
+
+	// Tells that something else was written over the indicator.
+	virtual void occupied() { }
+};
+
+// Adds up ticks from several threads, to be passed on to a progress
+// indicator by the thread that owns it.
+class tick_counter : public tickable {
+	atomic<uint64_t> count;
+
+public:
+	tick_counter() : count(0) { }
+
+	bool tick(uint64_t delta) {
+		count += delta;
+		return false;
+	}
+
+	uint64_t take() {
+		return count.exchange(0);
+	}
 };
 
 class progress : public tickable, non_copyable {
@@ -519,25 +852,70 @@ public:
 
 namespace file_utils
 {
-	static ssize_t really_read(const char *path,
-			int fd, void *buffer, ssize_t m)
+	// Entries that readdir reports as being neither directories nor
+	// regular files need not be stat'ed at all.
+	static bool needs_stat(unsigned char d_type) {
+		return d_type == DT_UNKNOWN || d_type == DT_DIR ||
+			d_type == DT_REG;
+	}
+
+#ifdef HAVE_STATX
+	// Only the type, device and inode are needed for directories, plus
+	// the size and permissions for regular files.
+	static unsigned statx_mask(unsigned char d_type) {
+		switch (d_type) {
+			case DT_DIR:
+				return STATX_TYPE | STATX_INO;
+			case DT_REG:
+				return STATX_TYPE | STATX_INO |
+					STATX_SIZE | STATX_MODE;
+			default:
+				return STATX_BASIC_STATS;
+		}
+	}
+
+	static void from_statx(const struct statx &sx, struct stat &st) {
+		st.st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+		st.st_ino = sx.stx_ino;
+		st.st_mode = sx.stx_mode;
+		st.st_size = (sx.stx_mask & STATX_SIZE) ? sx.stx_size : 0;
+	}
+#endif
+
+	// Fills st with what the traversal needs to know about the entry
+	// name of the directory open on at, d_type being the type reported
+	// by readdir.  Entries that need no stat get a null st_mode.
+	// Returns a negative value on error.
+	static int stat_entry(int at, const char *name, unsigned char d_type,
+			struct stat &st)
 	{
-		char *buffer_p = reinterpret_cast<char *>(buffer);
-		ssize_t n = 0;
+		if (!needs_stat(d_type)) {
+			st.st_mode = 0;
+			return 0;
+		}
 
-		while (m > 0) {
-			ssize_t r = read(fd, buffer_p, m);
-			if (r < 0) {
-				if (errno == EINTR) continue;
-				unix_rc::error(path);
+		if (d_type == DT_UNKNOWN)
+			return fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW);
+
+#ifdef HAVE_STATX
+		static atomic<bool> have_statx(true);
+
+		if (have_statx) {
+			struct statx sx;
+
+			if (statx(at, name, AT_SYMLINK_NOFOLLOW,
+						statx_mask(d_type), &sx) == 0) {
+				from_statx(sx, st);
+				return 0;
 			}
-			if (!r) break;
-			n += r;
-			m -= r;
-			buffer_p += r;
+
+			if (errno != ENOSYS)
+				return -1;
+			have_statx = false;
 		}
+#endif
 
-		return n;
+		return fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW);
 	}
 
 	__attribute__((unused))
@@ -554,293 +932,2452 @@ namespace file_utils
 		}
 	}
 
-	static int compare(const char *path1, const char *path2,
-			tickable *tck=NULL) {
-		const int buffer_size = 524288;
-		vector<uint8_t> buffer1(buffer_size), buffer2(buffer_size);
-		ssize_t m1, m2;
-
-		unix_fd fd1(open(path1, O_RDONLY));
-		unix_fd fd2(open(path2, O_RDONLY));
-
-		while (true) {
-			m1 = really_read(path1, fd1, &buffer1[0], buffer_size);
-			if (tck) tck->tick(m1);
-			m2 = really_read(path2, fd2, &buffer2[0], buffer_size);
-			if (tck) tck->tick(m2);
-			if (m1 != m2) return m1 ? -1 : 1;
-			if (!m1) return 0;
-			int c = memcmp(&buffer1[0], &buffer2[0], m1);
-			if (c) return c;
+	// Whether the block device dev is backed by a spinning disk, as
+	// far as sysfs tells.  For a partition, the answer is that of its
+	// disk.
+	static bool rotational(dev_t dev)
+	{
+		static const char *const names[] = {
+			"queue/rotational", "../queue/rotational"
+		};
+
+		for (auto name: names) {
+			string u = formatter::sprintf("/sys/dev/block/%u:%u/%s",
+					major(dev), minor(dev), name);
+			FILE *f = fopen(u.c_str(), "r");
+			int r = 0;
+
+			if (!f) continue;
+			bool ok = fscanf(f, "%d", &r) == 1;
+			fclose(f);
+			if (ok) return r != 0;
 		}
+		return false;
 	}
 
-	static void decompose(const string &path, string &dir, string &base)
+	// Gets the physical byte offset of the first extent of the file
+	// open on fd through FIEMAP, or 0 if no extent has been allocated
+	// yet.  Returns false if the filesystem cannot tell.
+	static bool first_extent(int fd, uint64_t &physical)
 	{
-		size_t i = path.find_last_of('/');
+#ifdef HAVE_LINUX_FIEMAP_H
+		uint64_t b[(sizeof(struct fiemap) +
+				sizeof(struct fiemap_extent)) / 8 + 1];
+		struct fiemap *fm = reinterpret_cast<struct fiemap *>(b);
+
+		memset(b, 0, sizeof(b));
+		fm->fm_length = FIEMAP_MAX_OFFSET;
+		fm->fm_extent_count = 1;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+			return false;
 
-		if (i == string::npos) {
-			dir.clear();
-			base = path;
-			return;
-		}
+		const struct fiemap_extent &e = fm->fm_extents[0];
+		const uint32_t unplaced = FIEMAP_EXTENT_UNKNOWN |
+			FIEMAP_EXTENT_DELALLOC;
 
-		dir = path.substr(0, i);
-		base = path.substr(i + 1, base.size() - i - 1);
+		physical = 0;
+		if (fm->fm_mapped_extents > 0 && !(e.fe_flags & unplaced))
+			physical = e.fe_physical;
+		return true;
+#else
+		return false;
+#endif
 	}
 
-	static string find_backup_name(const string &path) {
-		string dir, base;
+	// Gets the extents of the file open on fd through FIEMAP, as
+	// triples of logical offset, physical offset and length.  Returns
+	// false if the filesystem cannot tell, or if some extent is not
+	// shared with another file: two files with the same map then share
+	// all their blocks.  Encoded (compressed), inline and unaligned
+	// extents are refused too: the physical offset of a compressed
+	// extent is that of the whole extent, whichever part of it a file
+	// refers to, so files holding different data could have the same
+	// map.
+	static bool shared_extents(int fd, vector<uint64_t> &extents)
+	{
+		extents.clear();
+#ifdef HAVE_LINUX_FIEMAP_H
+		enum { batch = 32 };
+		uint64_t b[(sizeof(struct fiemap) +
+				batch * sizeof(struct fiemap_extent)) / 8 + 1];
+		struct fiemap *fm = reinterpret_cast<struct fiemap *>(b);
+		const uint32_t unplaced = FIEMAP_EXTENT_UNKNOWN |
+			FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+			FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED;
+		uint64_t start = 0;
+
+		for (;;) {
+			memset(b, 0, sizeof(b));
+			fm->fm_start = start;
+			fm->fm_length = FIEMAP_MAX_OFFSET - start;
+			fm->fm_extent_count = batch;
+			if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+				return false;
+			if (fm->fm_mapped_extents == 0)
+				break;
 
-		decompose(path, dir, base);
-		size_t m = min(size_t(FILENAME_MAX - 9), base.size());
-		base = base.substr(0, m);
+			for (unsigned i = 0; i < fm->fm_mapped_extents; i ++) {
+				const struct fiemap_extent &e =
+					fm->fm_extents[i];
 
-		static lcg g;
+				if (!(e.fe_flags & FIEMAP_EXTENT_SHARED) ||
+						(e.fe_flags & unplaced))
+					return false;
+				extents.push_back(e.fe_logical);
+				extents.push_back(e.fe_physical);
+				extents.push_back(e.fe_length);
+				if (e.fe_flags & FIEMAP_EXTENT_LAST)
+					return true;
+				start = e.fe_logical + e.fe_length;
+			}
+		}
+		return !extents.empty();
+#else
+		return false;
+#endif
+	}
 
-		uint32_t i = 0;
-		char buf[14];
-		string u;
-		struct stat st;
-		int rc;
+	enum { dedupe_chunk = 16 << 20, dedupe_batch = 64 };
+
+	enum { dedupe_shared = 0, dedupe_differs = 1 };
+
+	// Makes each of the files open on targets share the blocks of the
+	// size bytes of the file open on source through FIDEDUPERANGE, the
+	// kernel first checking that they hold the same bytes.  Ranges of
+	// dedupe_chunk bytes, the most btrfs takes at once, are shared
+	// with up to dedupe_batch files per call.  Sets status[i] to
+	// dedupe_shared if targets[i] now shares all its blocks, to
+	// dedupe_differs if its contents differ, or to an errno value
+	// negated, and shared[i] to the bytes the kernel reported sharing,
+	// which may be part of the file even when it differs.
+	static void dedupe(int source, off_t size, const vector<int> &targets,
+			vector<int> &status, vector<off_t> &shared)
+	{
+		const size_t m = targets.size();
+
+		status.assign(m, dedupe_shared);
+		shared.assign(m, 0);
+#ifdef FIDEDUPERANGE
+		vector<uint64_t> b((sizeof(struct file_dedupe_range) +
+				dedupe_batch *
+				sizeof(struct file_dedupe_range_info)) / 8 + 1);
+		struct file_dedupe_range *r =
+			reinterpret_cast<struct file_dedupe_range *>(b.data());
+		vector<size_t> live;
+
+		for (off_t offset = 0; offset < size; offset += dedupe_chunk) {
+			uint64_t n = min(off_t(dedupe_chunk), size - offset);
+
+			live.clear();
+			for (size_t i = 0; i < m; i ++)
+				if (status[i] == dedupe_shared)
+					live.push_back(i);
+			if (live.empty()) return;
+
+			for (size_t j = 0; j < live.size(); j += dedupe_batch) {
+				size_t k = min(live.size() - j,
+						size_t(dedupe_batch));
+
+				memset(b.data(), 0, b.size() * sizeof(b[0]));
+				r->src_offset = offset;
+				r->src_length = n;
+				r->dest_count = k;
+				for (size_t h = 0; h < k; h ++) {
+					file_dedupe_range_info &f = r->info[h];
+					f.dest_fd = targets[live[j + h]];
+					f.dest_offset = offset;
+				}
 
-		do {
-			do {
-				snprintf(buf, sizeof(buf), ".bak.%08x", g.get());
-				u = dir + "/" + base + buf;
-				rc = lstat(u.c_str(), &st);
-				if (rc < 0) {
-					if (errno == ENOENT)
-						return u;
-					unix_rc rc2(rc);
+				int rc = ioctl(source, FIDEDUPERANGE, r);
+				for (size_t h = 0; h < k; h ++) {
+					const file_dedupe_range_info &f =
+						r->info[h];
+					int &s = status[live[j + h]];
+
+					if (rc < 0)
+						s = -errno;
+					else if (f.status ==
+						FILE_DEDUPE_RANGE_DIFFERS)
+						s = dedupe_differs;
+					else if (f.status < 0)
+						s = f.status;
+					else if (f.bytes_deduped < n)
+						s = -EAGAIN;
+					if (rc == 0 && f.status >= 0)
+						shared[live[j + h]] +=
+							f.bytes_deduped;
 				}
-			} while (++ i);
-		} while(base.size() > 0);
+			}
+		}
+#else
+		status.assign(m, -EOPNOTSUPP);
+#endif
+	}
+
+	static void decompose(const string &path, string &dir, string &base)
+	{
+		size_t i = path.find_last_of('/');
+
+		if (i == string::npos) {
+			dir = ".";
+			base = path;
+			return;
+		}
 
-		throw std::runtime_error(
-				string("Can't find backup name for '") +
-				path +
-				string("'"));
+		dir = i ? path.substr(0, i) : string("/");
+		base = path.substr(i + 1);
 	}
 
+	// Replaces each of targets by a hard link to source.  Targets are
+	// handled a directory at a time, relative to a descriptor of their
+	// directory: source is linked to a temporary name there with
+	// linkat, which is then renamed over the target with renameat, so
+	// that a target is replaced atomically or left alone, at the cost
+	// of a few system calls that resolve a single component each.
+	// Targets that are links to source already are skipped: renaming
+	// the temporary name over them would do nothing and leave it
+	// behind.
 	static void hard_link(
 			const string &source,
 			const vector<string> &targets,
-			progress &pg,
+			tickable &pg,
 			const talk &talker) {
-		int rc;
-		unsigned i;
-		string t_i_bak;
+		static atomic<unsigned> serial(0);
+		string source_dir, source_base, dir, base;
+		struct stat sst, st;
+
+		decompose(source, source_dir, source_base);
+		int sfd = open(source_dir.c_str(), O_PATH | O_DIRECTORY);
+		if (sfd < 0) {
+			talker.warning("Skipping: can't open '%s': %s",
+					source_dir.c_str(), strerror(errno));
+			pg.occupied();
+			return;
+		}
+		if (fstatat(sfd, source_base.c_str(), &sst,
+					AT_SYMLINK_NOFOLLOW) < 0) {
+			talker.warning("Skipping: can't stat '%s': %s",
+					source.c_str(), strerror(errno));
+			pg.occupied();
+			close(sfd);
+			return;
+		}
 
-		vector<string> backup_names(targets.size());
+		vector< pair<string, string> > entries(targets.size());
+		for (size_t i = 0; i < targets.size(); i ++)
+			decompose(targets[i], entries[i].first,
+					entries[i].second);
+		sort(entries.begin(), entries.end());
 
-		for (i = 0; i < targets.size(); i ++) {
-			const string &t_i = targets[i];
-			t_i_bak = backup_names[i] = find_backup_name(t_i);
+		int dfd = -1;
+		for (size_t i = 0; i < entries.size(); i ++) {
+			const string &t_dir = entries[i].first;
+			const char *t_base = entries[i].second.c_str();
+			string t = t_dir + "/" + t_base;
 
 			pg.tick(1);
 
-			rc = rename(t_i.c_str(), t_i_bak.c_str());
-			if (rc < 0) {
-				talker.warning("Skipping: can't rename "
-					"'%s' to '%s': %s",
-					t_i.c_str(), t_i_bak.c_str(),
-					strerror(errno));
+			if (i == 0 || t_dir != entries[i - 1].first) {
+				if (dfd >= 0) close(dfd);
+				dfd = open(t_dir.c_str(),
+						O_PATH | O_DIRECTORY);
+			}
+			if (dfd < 0) {
+				talker.warning("Warning: can't open '%s': %s",
+					t_dir.c_str(), strerror(errno));
 				pg.occupied();
-				if (i) do {
-					i --;
-					const string t_i = targets[i];
-					t_i_bak = backup_names[i];
-					rc = rename(t_i_bak.c_str(),
-							t_i.c_str());
-					if (rc < 0) {
-						talker.warning(
-							"Furthermore, can't "
-							"rename "
-							"'%s' to '%s': %s",
-							t_i_bak.c_str(),
-							t_i.c_str(),
-							strerror(errno));
-						pg.occupied();
-					}
-				} while(i > 0);
-				return;
+				continue;
 			}
-		}
 
-		for (i = 0; i < targets.size(); i ++) {
-			string t_i = targets[i];
-			t_i_bak = backup_names[i];
-			rc = link(source.c_str(), t_i.c_str());
+			if (fstatat(dfd, t_base, &st, AT_SYMLINK_NOFOLLOW) == 0
+					&& st.st_dev == sst.st_dev &&
+					st.st_ino == sst.st_ino)
+				continue;
+
+			char tmp[32];
+			int rc;
+			do {
+				unsigned n = serial ++;
+				snprintf(tmp, sizeof(tmp), ".fhlink.%d.%u",
+						int(getpid()), n);
+				rc = linkat(sfd, source_base.c_str(), dfd,
+						tmp, 0);
+			} while (rc < 0 && errno == EEXIST);
+
 			if (rc < 0) {
 				talker.warning(
 					"Warning: can't link "
 					"'%s' to '%s': %s",
-					source.c_str(), t_i.c_str(),
+					source.c_str(), t.c_str(),
 					strerror(errno));
 				pg.occupied();
+				continue;
+			}
 
-				rc = rename(t_i.c_str(), t_i_bak.c_str());
-				if (rc < 0) {
-					talker.warning(
-						"Warning: can't restore "
-						"'%s' to '%s': %s",
-						t_i.c_str(), t_i_bak.c_str(),
-						strerror(errno));
-				}
-			} else {
-				rc = remove (t_i_bak.c_str());
-				if (rc < 0) {
+			if (renameat(dfd, tmp, dfd, t_base) < 0) {
+				talker.warning(
+					"Warning: can't rename "
+					"'%s/%s' to '%s': %s",
+					t_dir.c_str(), tmp, t.c_str(),
+					strerror(errno));
+				pg.occupied();
+				if (unlinkat(dfd, tmp, 0) < 0) {
 					talker.warning(
 						"Warning: can't remove "
-						"'%s': %s",
-						t_i_bak.c_str(),
+						"'%s/%s': %s",
+						t_dir.c_str(), tmp,
 						strerror(errno));
-					pg.occupied();
 				}
 			}
 		}
+
+		if (dfd >= 0) close(dfd);
+		close(sfd);
 	}
 };
 
-class checksummer
+// Read-only mappings of windows of files, for --io mmap, which hashes and
+// compares pages of the page cache in place instead of copying them.  A
+// file truncated after it was mapped raises SIGBUS when its lost pages
+// are touched, so code touching a mapping points guard at a jump buffer
+// while it does: the signal then makes it fail that file rather than
+// kill the process.
+namespace mapped_io
 {
-	enum { buffer_size_steps = 256 };
+	enum { window_size = 64 << 20 };
 
-public:
-	checksummer() { }
+	static thread_local sigjmp_buf *guard = NULL;
+	static thread_local void *fault_address = NULL;
+
+	static void on_sigbus(int sig, siginfo_t *si, void *)
+	{
+		if (!guard) {
+			signal(sig, SIG_DFL);
+			raise(sig);
+			return;
+		}
+		fault_address = si->si_addr;
+		siglongjmp(*guard, 1);
+	}
 
-	uint64_t checksum(const char *path)
+	static void install()
 	{
-		const int
-			step_size_words = 7,
-			step_size_bytes = step_size_words * sizeof(uint64_t);
-		uint64_t buffer[buffer_size_steps * step_size_words];
-		uint64_t a, b, c;
+		struct sigaction sa;
 
-		unix_fd fd(open(path, O_RDONLY));
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = on_sigbus;
+		sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+		unix_rc rc = sigaction(SIGBUS, &sa, NULL);
+	}
 
-		a = b = c = 0;
+	class window : non_copyable {
+		uint8_t *base;
+		size_t length;
+		off_t start;
+		size_t size;
 
-		while (true) {
-			ssize_t n = file_utils::really_read(path, fd, buffer,
-					sizeof(buffer));
+	public:
+		window() : base(NULL), length(0), start(0), size(0) { }
 
-			if (n == 0) break;
+		virtual ~window() {
+			unmap();
+		}
 
-			ssize_t nr = n % step_size_bytes;
-			if (nr) {
-				char *b = reinterpret_cast<char *>(buffer);
-				memset(b + n, 0, step_size_bytes - nr);
-			}
+		void unmap() {
+			if (base) munmap(base, length);
+			base = NULL;
+			length = size = 0;
+		}
 
-			unsigned n_steps = (n + nr) / step_size_bytes;
+		// Maps the n bytes at offset of the file open on fd, returning
+		// a pointer to them or NULL, with errno set.
+		const uint8_t *map(int fd, off_t offset, size_t n) {
+			static const off_t page = sysconf(_SC_PAGESIZE);
+			off_t aligned = offset & ~(page - 1);
+
+			unmap();
+			void *p = mmap(NULL, n + (offset - aligned), PROT_READ,
+					MAP_SHARED, fd, aligned);
+			if (p == MAP_FAILED) return NULL;
+
+			base = reinterpret_cast<uint8_t *>(p);
+			length = n + (offset - aligned);
+			start = offset;
+			size = n;
+			madvise(base, length, MADV_SEQUENTIAL);
+			return at(offset);
+		}
 
-			uint64_t *p = buffer;
+		off_t offset() const { return start; }
+		size_t bytes() const { return size; }
 
-			while (n_steps --) {
-				a += c;
-				a += *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a ^= *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a -= *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a ^= *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a += *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a ^= *(p ++); b = (b << 53) | (b >> 11); b += a;
-				a -= *(p ++); b = (b << 53) | (b >> 11); b += a;
-				c += b;
-			}
+		bool covers(off_t offset, size_t n) const {
+			return base && offset >= start &&
+				offset + off_t(n) <= start + off_t(size);
 		}
 
-		return c;
-	}
-};
+		const uint8_t *at(off_t offset) const {
+			return base + (length - size) + (offset - start);
+		}
 
-class filename_filter {
-public:
-	virtual ~filename_filter() { }
-	virtual bool accept(const char *u) = 0;
+		bool contains(const void *p) const {
+			const uint8_t *q = reinterpret_cast<const uint8_t *>(p);
+			return base && q >= base && q < base + length;
+		}
+	};
 };
 
-class all_filenames : public filename_filter {
+static const char *const io_modes[] = { "read", "mmap", "direct", 0 };
+
+// How the check phase reads files: with read(2), through mmap(2) or with
+// O_DIRECT, which bypasses the page cache, and whether it drops the pages
+// it has read from the page cache, so that a run over a large tree does
+// not evict the working set of everything else on the machine.  Counts
+// the bytes read and those advised to drop, which the kernel may not all
+// have cached or evicted.  The readers call ahead() before they need the
+// next part of a file, and move a cursor past the parts they are done
+// with.
+class io_policy : non_copyable {
 public:
-	all_filenames() { }
-	virtual ~all_filenames() { }
-	bool accept(const char *u) { return true; }
-};
+	enum mode { buffered, mapped, direct };
+	enum {
+		direct_align = 4096,
+		// The page cache may hold files in folios of a few MiB,
+		// which fadvise only drops whole.
+		drop_stride = 8 << 20
+	};
 
-class fnmatch_filter : public filename_filter {
-	const vector<string> &patterns;
+private:
+	mode m;
+	bool dropping;
+	atomic<uint64_t> read_bytes, dropped_bytes;
 
 public:
-	fnmatch_filter(const vector<string> &Patterns) :
-		patterns(Patterns)
+	io_policy(const string &Mode, bool Dropping) :
+		m(Mode == "mmap" ? mapped :
+			Mode == "direct" ? direct : buffered),
+		dropping(Dropping && m != direct),
+		read_bytes(0),
+		dropped_bytes(0)
 	{
 	}
-	virtual ~fnmatch_filter() { }
-	bool accept(const char *u) {
-		for (auto &p: patterns) {
-			if (fnmatch(p.c_str(), u, 0) == 0)
-				return false;
+
+	bool is_mapped() const { return m == mapped; }
+	bool is_direct() const { return m == direct; }
+	bool drops() const { return dropping; }
+
+	// Opens path for reading, with O_DIRECT if asked and supported by
+	// its filesystem.  Returns -1 with errno set on failure.
+	int open(const char *path) const {
+		if (m == direct) {
+			int fd = ::open(path, O_RDONLY | O_DIRECT);
+			if (fd >= 0 || errno != EINVAL) return fd;
 		}
-		return true;
-	}
-};
 
-all_filenames all_filenames_singleton;
+		int fd = ::open(path, O_RDONLY);
+		if (fd >= 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		return fd;
+	}
 
-class file_comparator : non_copyable
-{
-	const vector<string> &names;
-	typedef pair<unsigned, unsigned> couple;
-	map<couple, int> results;
-	tickable *tck;
+	// Reads up to n bytes at offset, stopping early only at the end
+	// of the file.  With O_DIRECT, b, n and offset must be aligned.
+	// Returns -1 with errno set on failure.
+	ssize_t read(int fd, void *b, size_t n, off_t offset) {
+		uint8_t *p = reinterpret_cast<uint8_t *>(b);
+		size_t k = 0;
 
-	file_comparator();
-	file_comparator(const file_comparator&);
-	file_comparator &operator=(const file_comparator&);
+		while (k < n) {
+			ssize_t r = pread(fd, p + k, n - k, offset + k);
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			if (!r) break;
+			k += r;
+			// An unaligned count is the end of a direct read.
+			if (m == direct && k % direct_align) break;
+		}
 
-public:
-	file_comparator(const vector<string> &Names, tickable *Tck=NULL) :
-		names(Names),
-		tck(Tck)
-	{
+		read_bytes += k;
+		return k;
 	}
 
-	virtual ~file_comparator() { }
+	// Counts n bytes used through a mapping.
+	void mapped_read(size_t n) {
+		read_bytes += n;
+	}
 
-	int operator()(unsigned i, unsigned j) {
-		assert (0 <= i && i < names.size());
-		assert (0 <= j && j < names.size());
-		if (i == j) return 0;
-		if (i > j) return -operator()(j, i);
-		auto it = results.find(couple(i, j));
-		if (it == results.end()) {
-			int r = file_utils::compare(
-					names[i].c_str(),
-					names[j].c_str(),
-					tck);
+	void ahead(int fd, off_t offset, off_t n) const {
+		if (m == buffered)
+			posix_fadvise(fd, offset, n, POSIX_FADV_WILLNEED);
+	}
 
-			results[couple(i,j)] = r;
-			return r;
-		} else return it->second;
+	// Advises the kernel to drop n bytes at offset, or up to the end
+	// of the file.
+	void drop(int fd, off_t offset, off_t n, bool to_end=false) {
+		if (!dropping || (n <= 0 && !to_end)) return;
+		posix_fadvise(fd, offset, to_end ? 0 : n,
+				POSIX_FADV_DONTNEED);
+		dropped_bytes += n;
 	}
 
-	class proxy {
-		file_comparator &target;
+	// The point up to which a reader moving forward through a file
+	// is done with it.  Pages behind it are dropped in aligned strides
+	// as it moves, and the rest when the reader is done.
+	class cursor {
+		off_t behind;
 
 	public:
-		proxy(file_comparator &Target) : target(Target) { }
-		bool operator()(unsigned i, unsigned j) {
-			int r = target(i, j);
-			return r < 0;
+		cursor(off_t Start=0) : behind(Start) { }
+
+		void advance(io_policy &io, int fd, off_t offset) {
+			off_t a = offset & ~off_t(drop_stride - 1);
+			if (a > behind) {
+				io.drop(fd, behind, a - behind);
+				behind = a;
+			}
+		}
+
+		// The reader is done at offset, the end of the file if
+		// at_end is set.
+		void finish(io_policy &io, int fd, off_t offset, bool at_end) {
+			io.drop(fd, behind, offset - behind, at_end);
+			behind = max(behind, offset);
 		}
 	};
+
+	uint64_t bytes_read() const { return read_bytes; }
+	uint64_t bytes_dropped() const { return dropped_bytes; }
 };
 
-class trie {
-	bool terminal;
-	typedef map<char, trie> dictionary;
-	dictionary entries;
+io_policy default_io_policy("read", false);
+
+// Page-aligned memory, suitable for O_DIRECT.  It only ever grows, so
+// that once a buffer is large enough, using it allocates nothing.
+class block_arena : non_copyable {
+	void *base;
+	size_t size;
+
+public:
+	block_arena() : base(NULL), size(0) { }
+
+	virtual ~block_arena() {
+		if (base) munmap(base, size);
+	}
+
+	uint8_t *get(size_t n) {
+		if (n > size) {
+			n = max(n, 2 * size);
+			if (base) munmap(base, size);
+			base = mmap(NULL, n, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			size = n;
+			if (base == MAP_FAILED) {
+				base = NULL;
+				size = 0;
+				throw runtime_error(
+					"Cannot allocate I/O buffers");
+			}
+		}
+		return reinterpret_cast<uint8_t *>(base);
+	}
+};
+
+// The checksum runs eight independent 64-bit lanes over the data, lane i
+// taking word i of each 64-byte stripe, so that the inner loop can be
+// spread over vector registers.  All kernels compute the same digest and
+// only differ in how many lanes they process per instruction.
+namespace checksum_kernels
+{
+	enum {
+		lanes = 8,
+		stripe_bytes = lanes * sizeof(uint64_t),
+		block_stripes = 16
+	};
+
+	// Stripe s of a block is mixed with words s to s + 7, so that
+	// swapping two stripes changes the digest.  The last lanes words
+	// are used to scramble the lanes after each block.
+	static const uint64_t secret[block_stripes + lanes] = {
+		0x2cb0f69f4abea221, 0x9417034723148989, 0xdd555950609dfe03,
+		0xdbafb150deb12800, 0x7e789b2e6c442cb6, 0xf41e5636c7e4f8c4,
+		0x0959d150f8fba7e4, 0xa97316f13cdb9eea, 0x74cd8258f9520068,
+		0x55c74a62e116868b, 0xd2f4c799a2023cbd, 0xdf98cb79a37b51b9,
+		0x396f5885524f3905, 0xaf1d56386ca3b276, 0xa9ffbe6b5104e85a,
+		0x6bd0c51b9fd533b3, 0x980ce91c50ab4b56, 0x28ac395780fe62c5,
+		0x768912e3a6bcedc7, 0x50b3e8c9332c7c88, 0xce3bbfe520bd47da,
+		0xcba6c8e8e0bb7c4f, 0xbf194db8434a346d, 0x7d8f2a7b60416d7f,
+	};
+
+	static const uint64_t prime_64 = 0x9e3779b97f4a7c15ULL;
+	static const uint64_t prime_32 = 0x9e3779b1;
+
+	// Absorbs n stripes from p into acc, phase being the index of the
+	// first stripe within its block.
+	typedef void (*kernel)(uint64_t *acc, const uint64_t *p, size_t n,
+			unsigned phase);
+
+	// W is the number of lanes per vector.  This is always inlined into
+	// the kernels below, which are compiled for their instruction set.
+	template<int W>
+	static inline __attribute__((always_inline))
+	void absorb(uint64_t *acc, const uint64_t *p, size_t n, unsigned phase)
+	{
+		typedef uint64_t vec __attribute__((vector_size(8 * W)));
+		enum { regs = lanes / W };
+
+		vec a[regs], d, k;
+
+		for (int r = 0; r < regs; r++)
+			memcpy(&a[r], acc + r * W, sizeof(vec));
+
+		while (n --) {
+			for (int r = 0; r < regs; r++) {
+				memcpy(&d, p + r * W, sizeof(vec));
+				memcpy(&k, secret + phase + r * W, sizeof(vec));
+				k ^= d;
+				a[r] += (k & 0xffffffff) * (k >> 32) + d;
+			}
+			p += lanes;
+
+			if (++ phase < block_stripes) continue;
+			phase = 0;
+
+			for (int r = 0; r < regs; r++) {
+				memcpy(&k, secret + block_stripes + r * W,
+						sizeof(vec));
+				a[r] ^= a[r] >> 47;
+				a[r] ^= k;
+				a[r] *= prime_32;
+			}
+		}
+
+		for (int r = 0; r < regs; r++)
+			memcpy(acc + r * W, &a[r], sizeof(vec));
+	}
+
+	static void scalar(uint64_t *acc, const uint64_t *p, size_t n,
+			unsigned phase)
+	{
+		absorb<1>(acc, p, n, phase);
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	__attribute__((target("sse2")))
+	static void sse2(uint64_t *acc, const uint64_t *p, size_t n,
+			unsigned phase)
+	{
+		absorb<2>(acc, p, n, phase);
+	}
+
+	__attribute__((target("avx2")))
+	static void avx2(uint64_t *acc, const uint64_t *p, size_t n,
+			unsigned phase)
+	{
+		absorb<4>(acc, p, n, phase);
+	}
+
+	__attribute__((target("avx512f")))
+	static void avx512(uint64_t *acc, const uint64_t *p, size_t n,
+			unsigned phase)
+	{
+		absorb<8>(acc, p, n, phase);
+	}
+#endif
+
+	struct entry {
+		const char *name;
+		kernel k;
+	};
+
+	// The kernels this CPU can run, from the slowest to the fastest.
+	static vector<entry> supported()
+	{
+		vector<entry> v;
+
+		v.push_back(entry{"scalar", scalar});
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2"))
+			v.push_back(entry{"sse2", sse2});
+		if (__builtin_cpu_supports("avx2"))
+			v.push_back(entry{"avx2", avx2});
+		if (__builtin_cpu_supports("avx512f"))
+			v.push_back(entry{"avx512", avx512});
+#endif
+		return v;
+	}
+
+	static const entry &best()
+	{
+		static const entry e = supported().back();
+		return e;
+	}
+}
+
+// A digest of up to 256 bits.
+struct digest {
+	uint64_t w[4];
+	unsigned words;
+
+	digest(uint64_t W0 = 0) : words(1) {
+		w[0] = W0;
+		w[1] = w[2] = w[3] = 0;
+	}
+
+	bool operator<(const digest &b) const {
+		return lexicographical_compare(w, w + 4, b.w, b.w + 4);
+	}
+
+	bool operator!=(const digest &b) const {
+		return !equal(w, w + 4, b.w);
+	}
+
+	string hex() const {
+		string u;
+		char buf[17];
+
+		for (unsigned i = 0; i < words; i++) {
+			snprintf(buf, sizeof(buf), "%016" PRIx64, w[i]);
+			u += buf;
+		}
+		return u;
+	}
+};
+
+class hash_engine : non_copyable {
+public:
+	virtual ~hash_engine() { }
+	virtual void reset() = 0;
+
+	// Absorbs n bytes at p.  The bytes following them up to the next
+	// multiple of 64 may be overwritten.
+	virtual void update(uint64_t *p, size_t n) = 0;
+	virtual digest result() const = 0;
+
+	// Whether equal digests can be taken to mean equal contents.
+	virtual bool strong() const = 0;
+
+	// A new engine of the same kind.
+	virtual hash_engine *clone() const = 0;
+
+	// The number of 64-bit words of the digests.
+	virtual unsigned digest_words() const = 0;
+};
+
+// The lane checksum, finalized into 64 or 128 bits.
+class lane_hash : public hash_engine {
+	enum {
+		lanes = checksum_kernels::lanes,
+		stripe_bytes = checksum_kernels::stripe_bytes
+	};
+
+	const unsigned words;
+	checksum_kernels::kernel kernel;
+	uint64_t acc[lanes];
+	unsigned phase;
+	uint64_t length;
+
+	static uint64_t avalanche(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	// Folds the lanes into one word.  Each salt gives a different,
+	// independent looking fold.
+	uint64_t fold(uint64_t salt) const {
+		uint64_t h = (length ^ salt) * checksum_kernels::prime_64;
+
+		for (int i = 0; i < lanes; i++)
+			h = (h ^ avalanche(acc[i] ^ salt)) *
+				checksum_kernels::prime_64;
+
+		return avalanche(h);
+	}
+
+public:
+	lane_hash(unsigned Words,
+			checksum_kernels::kernel K =
+				checksum_kernels::best().k) :
+		words(Words),
+		kernel(K)
+	{
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < lanes; i++)
+			acc[i] = checksum_kernels::prime_64 * (i + 1);
+		phase = 0;
+		length = 0;
+	}
+
+	void update(uint64_t *p, size_t n) {
+		size_t n_stripes = n / stripe_bytes;
+		size_t nr = n % stripe_bytes;
+
+		if (nr) {
+			memset(reinterpret_cast<char *>(p) + n, 0,
+					stripe_bytes - nr);
+			n_stripes ++;
+		}
+
+		kernel(acc, p, n_stripes, phase);
+		phase = (phase + n_stripes) % checksum_kernels::block_stripes;
+		length += n;
+	}
+
+	digest result() const {
+		digest d(fold(0));
+
+		if (words > 1) {
+			d.w[1] = fold(checksum_kernels::secret[0]);
+			d.words = 2;
+		}
+		return d;
+	}
+
+	bool strong() const { return false; }
+
+	hash_engine *clone() const {
+		return new lane_hash(words, kernel);
+	}
+
+	unsigned digest_words() const { return words; }
+};
+
+// BLAKE3 in its default hashing mode with a 256-bit output.
+class blake3_hash : public hash_engine {
+	enum {
+		block_len = 64,
+		chunk_len = 1024,
+		chunk_start = 1,
+		chunk_end = 2,
+		parent = 4,
+		root = 8,
+		max_depth = 54
+	};
+
+	static const uint32_t iv[8];
+	// The order of the message words in each round.
+	static const uint8_t schedule[7][16];
+
+	// The chunk being hashed.
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	uint8_t block[block_len];
+	unsigned block_used;
+	unsigned blocks_compressed;
+
+	// Chaining values of complete subtrees, largest first.
+	uint32_t stack[max_depth][8];
+	unsigned stack_len;
+
+	// The state is held as four rows of four words, so that the four
+	// column (then diagonal) mixes of a round run side by side.
+	typedef uint32_t row __attribute__((vector_size(16)));
+
+	static row rotr(row x, int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	static inline __attribute__((always_inline))
+	void g(row &a, row &b, row &c, row &d, row x, row y)
+	{
+		a += b + x;
+		d = rotr(d ^ a, 16);
+		c += d;
+		b = rotr(b ^ c, 12);
+		a += b + y;
+		d = rotr(d ^ a, 8);
+		c += d;
+		b = rotr(b ^ c, 7);
+	}
+
+	static void compress(const uint32_t *chaining, const uint8_t *b,
+			uint64_t counter, uint32_t len, uint32_t flags,
+			uint32_t *out)
+	{
+		uint32_t m[16];
+
+		for (int i = 0; i < 16; i++)
+			m[i] = uint32_t(b[4 * i]) |
+				uint32_t(b[4 * i + 1]) << 8 |
+				uint32_t(b[4 * i + 2]) << 16 |
+				uint32_t(b[4 * i + 3]) << 24;
+
+		row r0 = { chaining[0], chaining[1], chaining[2], chaining[3] };
+		row r1 = { chaining[4], chaining[5], chaining[6], chaining[7] };
+		row r2 = { iv[0], iv[1], iv[2], iv[3] };
+		row r3 = { uint32_t(counter), uint32_t(counter >> 32),
+			len, flags };
+
+		for (int r = 0; r < 7; r++) {
+			const uint8_t *x = schedule[r];
+			row x0 = { m[x[0]], m[x[2]], m[x[4]], m[x[6]] };
+			row y0 = { m[x[1]], m[x[3]], m[x[5]], m[x[7]] };
+			row x1 = { m[x[8]], m[x[10]], m[x[12]], m[x[14]] };
+			row y1 = { m[x[9]], m[x[11]], m[x[13]], m[x[15]] };
+
+			g(r0, r1, r2, r3, x0, y0);
+			r1 = __builtin_shuffle(r1, row{1, 2, 3, 0});
+			r2 = __builtin_shuffle(r2, row{2, 3, 0, 1});
+			r3 = __builtin_shuffle(r3, row{3, 0, 1, 2});
+			g(r0, r1, r2, r3, x1, y1);
+			r1 = __builtin_shuffle(r1, row{3, 0, 1, 2});
+			r2 = __builtin_shuffle(r2, row{2, 3, 0, 1});
+			r3 = __builtin_shuffle(r3, row{1, 2, 3, 0});
+		}
+
+		r0 ^= r2;
+		r1 ^= r3;
+		memcpy(out, &r0, sizeof(r0));
+		memcpy(out + 4, &r1, sizeof(r1));
+	}
+
+	// Stores 8 words in little-endian order.
+	static void store(uint8_t *b, const uint32_t *w) {
+		for (int i = 0; i < 32; i++)
+			b[i] = w[i / 4] >> (8 * (i % 4));
+	}
+
+	static void parent_cv(const uint32_t *left, const uint32_t *right,
+			uint32_t *out)
+	{
+		uint8_t b[block_len];
+
+		store(b, left);
+		store(b + 32, right);
+		compress(iv, b, 0, block_len, parent, out);
+	}
+
+	uint32_t start_flag() const {
+		return blocks_compressed ? 0 : chunk_start;
+	}
+
+	void start_chunk(uint64_t counter) {
+		memcpy(cv, iv, sizeof(cv));
+		chunk_counter = counter;
+		block_used = 0;
+		blocks_compressed = 0;
+	}
+
+	// Pushes the chaining value of a finished chunk, merging it with
+	// the subtrees it completes.  total is the number of chunks so far.
+	void push_chunk(uint32_t *chunk_cv, uint64_t total) {
+		while (!(total & 1)) {
+			parent_cv(stack[-- stack_len], chunk_cv, chunk_cv);
+			total >>= 1;
+		}
+		memcpy(stack[stack_len ++], chunk_cv, sizeof(cv));
+	}
+
+public:
+	blake3_hash() {
+		reset();
+	}
+
+	void reset() {
+		start_chunk(0);
+		stack_len = 0;
+	}
+
+	void update(uint64_t *p, size_t n) {
+		const uint8_t *q = reinterpret_cast<const uint8_t *>(p);
+
+		while (n > 0) {
+			if (blocks_compressed * block_len + block_used ==
+					chunk_len) {
+				uint32_t out[8];
+
+				compress(cv, block, chunk_counter, block_len,
+						start_flag() | chunk_end, out);
+				push_chunk(out, chunk_counter + 1);
+				start_chunk(chunk_counter + 1);
+			}
+
+			if (block_used == block_len) {
+				compress(cv, block, chunk_counter, block_len,
+						start_flag(), cv);
+				blocks_compressed ++;
+				block_used = 0;
+			}
+
+			size_t k = min(n, size_t(block_len - block_used));
+			memcpy(block + block_used, q, k);
+			block_used += k;
+			q += k;
+			n -= k;
+		}
+	}
+
+	digest result() const {
+		uint8_t b[block_len];
+		uint32_t chaining[8], out[8];
+		uint64_t counter = chunk_counter;
+		uint32_t len = block_used;
+		uint32_t flags = start_flag() | chunk_end;
+
+		memset(b, 0, sizeof(b));
+		memcpy(b, block, block_used);
+		memcpy(chaining, cv, sizeof(chaining));
+
+		// The last chunk is merged with the stack from the top; the
+		// last node to be compressed is the root.
+		for (unsigned i = stack_len; i > 0; i--) {
+			compress(chaining, b, counter, len, flags, out);
+			store(b, stack[i - 1]);
+			store(b + 32, out);
+			memcpy(chaining, iv, sizeof(chaining));
+			counter = 0;
+			len = block_len;
+			flags = parent;
+		}
+		compress(chaining, b, counter, len, flags | root, out);
+
+		// Big-endian words, so that hex() shows the usual digest.
+		digest d;
+		d.words = 4;
+		for (int i = 0; i < 4; i++)
+			d.w[i] = uint64_t(__builtin_bswap32(out[2 * i])) << 32 |
+				__builtin_bswap32(out[2 * i + 1]);
+		return d;
+	}
+
+	bool strong() const { return true; }
+
+	hash_engine *clone() const {
+		return new blake3_hash();
+	}
+
+	unsigned digest_words() const { return 4; }
+};
+
+const uint32_t blake3_hash::iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+const uint8_t blake3_hash::schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static const char *const hash_names[] = { "fast64", "fast128", "blake3", 0 };
+
+static hash_engine *new_hash_engine(const string &name)
+{
+	if (name == "fast128")
+		return new lane_hash(2);
+	if (name == "blake3")
+		return new blake3_hash();
+	return new lane_hash(1);
+}
+
+// Hashes files, or parts of them, with a hash engine.  Files larger than
+// a leaf are hashed as a tree: the digests of their leaves, which can be
+// computed in parallel, are hashed together with the size of the file.
+class checksummer : non_copyable
+{
+	enum {
+		buffer_size_bytes = 128 * 1024,
+		tree_leaf_size = 8 << 20
+	};
+
+	unique_ptr<hash_engine> engine;
+	io_policy &io;
+	block_arena buffer;
+
+	static size_t buffer_size() {
+		return buffer_size_bytes + 2 * io_policy::direct_align;
+	}
+
+	// Hashes the m bytes at offset of the file open on fd, or up to its
+	// end, a buffer at b at a time.  With O_DIRECT, reads are widened to
+	// aligned boundaries and the data moved to the start of b.
+	static void absorb_read(const char *path, int fd, off_t offset,
+			off_t m, io_policy &io, hash_engine &e, uint8_t *b)
+	{
+		const off_t align = io.is_direct() ?
+			io_policy::direct_align : 1;
+		io_policy::cursor behind(offset);
+		bool at_end = false;
+
+		while (m > 0) {
+			off_t k = min(off_t(buffer_size_bytes), m);
+			off_t start = offset & ~(align - 1);
+			off_t end = (offset + k + align - 1) & ~(align - 1);
+
+			io.ahead(fd, offset + k, buffer_size_bytes);
+			ssize_t n = io.read(fd, b, end - start, start);
+			if (n < 0) unix_rc::error(path);
+			n = max(off_t(0), min(k, n - (offset - start)));
+			if (n > 0 && offset > start)
+				memmove(b, b + (offset - start), n);
+			if (n > 0)
+				e.update(reinterpret_cast<uint64_t *>(b), n);
+			offset += n;
+			m -= n;
+			behind.advance(io, fd, offset);
+			if (n < k) {
+				at_end = true;
+				break;
+			}
+		}
+		behind.finish(io, fd, offset, at_end);
+	}
+
+	// Hashes the m bytes at offset of the file open on fd through
+	// mappings of it, in the same pieces as reading it would, so that
+	// the digests do not depend on the I/O mode.  Pieces are copied to
+	// b when the engine would pad them in place.
+	static void absorb_mapped(const char *path, int fd, off_t offset,
+			off_t m, io_policy &io, hash_engine &e, uint8_t *b)
+	{
+		mapped_io::window w;
+		io_policy::cursor behind(offset);
+		sigjmp_buf jb;
+
+		if (sigsetjmp(jb, 0)) {
+			mapped_io::guard = NULL;
+			throw runtime_error("File truncated while mapped");
+		}
+
+		for (off_t i = 0; i < m; i += mapped_io::window_size) {
+			size_t n = min(off_t(mapped_io::window_size), m - i);
+			const uint8_t *q = w.map(fd, offset + i, n);
+			if (!q) unix_rc::error(path);
+
+			mapped_io::guard = &jb;
+			for (size_t j = 0; j < n; j += buffer_size_bytes) {
+				size_t k = min(size_t(buffer_size_bytes),
+						n - j);
+				const uint8_t *p = q + j;
+
+				if (k % 64 || uintptr_t(p) % 8) {
+					memcpy(b, p, k);
+					p = b;
+				}
+				e.update(reinterpret_cast<uint64_t *>(
+						const_cast<uint8_t *>(p)), k);
+			}
+			mapped_io::guard = NULL;
+
+			w.unmap();
+			io.mapped_read(n);
+			behind.advance(io, fd, offset + i + n);
+		}
+		behind.finish(io, fd, offset + m, false);
+	}
+
+	static void absorb(const char *path, int fd, off_t offset, off_t m,
+			io_policy &io, hash_engine &e, uint8_t *b)
+	{
+		if (io.is_mapped())
+			absorb_mapped(path, fd, offset, m, io, e, b);
+		else
+			absorb_read(path, fd, offset, m, io, e, b);
+	}
+
+	// Hashes leaves of the file open on fd, taking the next one from
+	// next until there are none left.
+	static void hash_leaves(const char *path, int fd, off_t size,
+			io_policy &io, hash_engine &e, vector<digest> &leaves,
+			atomic<size_t> &next)
+	{
+		block_arena b;
+
+		for (size_t k; (k = next ++) < leaves.size();) {
+			off_t offset = off_t(k) * tree_leaf_size;
+			off_t end = min(size, offset + tree_leaf_size);
+
+			e.reset();
+			absorb(path, fd, offset, end - offset, io, e,
+					b.get(buffer_size()));
+			leaves[k] = e.result();
+		}
+	}
+
+	// Hashes the m bytes at offset, or up to the end of the file.
+	void absorb(const char *path, int fd, off_t offset, off_t m)
+	{
+		absorb(path, fd, offset, m, io, *engine,
+				buffer.get(buffer_size()));
+	}
+
+public:
+	checksummer(hash_engine *Engine, io_policy &Io=default_io_policy) :
+		engine(Engine),
+		io(Io)
+	{ }
+
+	digest checksum(const char *path)
+	{
+		unix_fd fd(io.open(path));
+		off_t m = numeric_limits<off_t>::max();
+
+		if (io.is_mapped()) {
+			struct stat st;
+			if (fstat(fd, &st) < 0) unix_rc::error(path);
+			m = st.st_size;
+		}
+
+		engine->reset();
+		absorb(path, fd, 0, m);
+		return engine->result();
+	}
+
+	static bool is_tree(off_t size) {
+		return size > tree_leaf_size;
+	}
+
+	static off_t leaf_size() {
+		return tree_leaf_size;
+	}
+
+	// Hashes a file of the given size, as a tree if it is larger than
+	// a leaf, reading up to the given number of leaves at once.
+	digest checksum(const char *path, off_t size, unsigned threads)
+	{
+		if (size <= tree_leaf_size)
+			return checksum(path);
+
+		unix_fd fd(io.open(path));
+		vector<digest> leaves((size + tree_leaf_size - 1) /
+				tree_leaf_size);
+		atomic<size_t> next(0);
+		vector<thread> helpers;
+		vector< unique_ptr<hash_engine> > engines;
+		mutex m;
+		exception_ptr failure;
+
+		threads = max(1u, min(threads, unsigned(leaves.size())));
+
+		// If a helper can't be started, those already running are
+		// stopped and joined before giving up.
+		try {
+			for (unsigned k = 1; k < threads; k ++) {
+				engines.push_back(unique_ptr<hash_engine>(
+							engine->clone()));
+				hash_engine &e = *engines.back();
+
+				helpers.push_back(thread([&, path]() {
+					try {
+						hash_leaves(path, fd, size, io,
+							e, leaves, next);
+					} catch(...) {
+						lock_guard<mutex> lock(m);
+						failure =
+							current_exception();
+						next = leaves.size();
+					}
+				}));
+			}
+		} catch(...) {
+			next = leaves.size();
+			for (auto &t: helpers)
+				t.join();
+			throw;
+		}
+
+		try {
+			hash_leaves(path, fd, size, io, *engine,
+					leaves, next);
+		} catch(...) {
+			lock_guard<mutex> lock(m);
+			failure = current_exception();
+			next = leaves.size();
+		}
+
+		for (auto &t: helpers)
+			t.join();
+		if (failure)
+			rethrow_exception(failure);
+
+		// The root: the size, then the leaf digests.
+		vector<uint64_t> root;
+
+		root.push_back(size);
+		for (auto &d: leaves)
+			root.insert(root.end(), d.w, d.w + d.words);
+		root.resize(root.size() + 8);
+
+		engine->reset();
+		engine->update(root.data(), (root.size() - 8) * 8);
+		return engine->result();
+	}
+
+	// Hashes only the first and last n bytes of a file of the given
+	// size.  Files that differ there, which is most of them, can then
+	// be told apart without reading them whole.
+	digest sample(const char *path, off_t size, off_t n)
+	{
+		unix_fd fd(io.open(path));
+
+		engine->reset();
+		if (size <= 2 * n) {
+			absorb(path, fd, 0, size);
+		} else {
+			absorb(path, fd, 0, n);
+			absorb(path, fd, size - n, n);
+		}
+		return engine->result();
+	}
+
+	// Hashes n bytes of memory in pieces of the given size, which must
+	// be a multiple of 64.
+	digest checksum(uint64_t *p, size_t n, size_t piece)
+	{
+		engine->reset();
+		for (; n > piece; n -= piece, p += piece / sizeof(uint64_t))
+			engine->update(p, piece);
+		engine->update(p, n);
+		return engine->result();
+	}
+};
+
+// Digests computed in earlier runs, keyed by device, inode and a
+// fingerprint of the size and modification times of each file.  The file
+// holds a header followed by fixed-size records sorted by device and
+// inode, so that it is used in place through mmap and searched by
+// bisection.  It is rewritten after each run with the records of the
+// files that were examined, merged with those of the files that were
+// not.
+class hash_cache : non_copyable {
+public:
+	struct key {
+		uint64_t ino;
+		uint64_t meta;
+		uint32_t dev;
+
+		bool operator<(const key &b) const {
+			return dev < b.dev || (dev == b.dev && ino < b.ino);
+		}
+	};
+
+	struct entry {
+		key k;
+		bool has_sample, has_full;
+		digest sample, full;
+
+		entry() : has_sample(false), has_full(false) { }
+	};
+
+private:
+	enum {
+		version = 1,
+		has_sample_flag = 1,
+		has_full_flag = 2
+	};
+
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t words;
+		char hash[16];
+		uint64_t prehash_size;
+		uint64_t leaf_size;
+		uint64_t count;
+	};
+
+	// Followed by the sample then the full digest, words each.
+	struct record {
+		uint64_t ino;
+		uint64_t meta;
+		uint32_t dev;
+		uint32_t flags;
+	};
+
+	const string path;
+	header h;
+	const char *map;
+	size_t map_size;
+	const char *records;
+	size_t count;
+	bool samples_valid;
+
+	size_t record_size() const {
+		return sizeof(record) + 2 * h.words * sizeof(uint64_t);
+	}
+
+	const record &at(size_t i) const {
+		return *reinterpret_cast<const record *>(
+				records + i * record_size());
+	}
+
+	static uint64_t mix(uint64_t h, uint64_t x) {
+		h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+		return h ^ (h >> 29);
+	}
+
+public:
+	hash_cache(const string &Path, const string &Hash, unsigned Words,
+			off_t Prehash_size, off_t Leaf_size) :
+		path(Path),
+		map(0),
+		map_size(0),
+		records(0),
+		count(0),
+		samples_valid(false)
+	{
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "FHLCACHE", 8);
+		h.version = version;
+		h.words = Words;
+		strncpy(h.hash, Hash.c_str(), sizeof(h.hash) - 1);
+		h.prehash_size = Prehash_size;
+		h.leaf_size = Leaf_size;
+	}
+
+	virtual ~hash_cache() {
+		if (map) munmap(const_cast<char *>(map), map_size);
+	}
+
+	static key make_key(const struct stat &st) {
+		key k;
+
+		k.ino = st.st_ino;
+		k.dev = (major(st.st_dev) << 20) | minor(st.st_dev);
+		k.meta = mix(mix(mix(0, st.st_size),
+				st.st_mtim.tv_sec * 1000000000LL +
+				st.st_mtim.tv_nsec),
+				st.st_ctim.tv_sec * 1000000000LL +
+				st.st_ctim.tv_nsec);
+		return k;
+	}
+
+	size_t size() const { return count; }
+
+	// Maps the cache file.  A missing file is an empty cache; a file
+	// written with another hash or version is ignored, and why says so.
+	void load(string &why)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno != ENOENT)
+				why = strerror(errno);
+			return;
+		}
+
+		unix_fd ufd(fd);
+		struct stat st;
+		unix_rc rc = fstat(fd, &st);
+
+		if (size_t(st.st_size) < sizeof(header)) {
+			why = "truncated";
+			return;
+		}
+
+		void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			why = strerror(errno);
+			return;
+		}
+		map = static_cast<const char *>(p);
+		map_size = st.st_size;
+
+		const header &fh = *reinterpret_cast<const header *>(map);
+
+		if (memcmp(fh.magic, h.magic, sizeof(h.magic)) ||
+				fh.version != h.version) {
+			why = "not a cache of this version";
+			return;
+		}
+		if (fh.words != h.words || fh.leaf_size != h.leaf_size ||
+				strncmp(fh.hash, h.hash, sizeof(h.hash))) {
+			why = formatter::sprintf("written with --hash %.16s",
+					fh.hash);
+			return;
+		}
+		if (map_size != sizeof(header) + fh.count * record_size()) {
+			why = "truncated";
+			return;
+		}
+
+		records = map + sizeof(header);
+		count = fh.count;
+		samples_valid = fh.prehash_size == h.prehash_size;
+		madvise(p, map_size, MADV_RANDOM);
+	}
+
+	// Looks k up.  On a hit, its digests are copied into e.
+	bool find(const key &k, entry &e) const
+	{
+		size_t a = 0, b = count;
+
+		while (a < b) {
+			size_t c = a + (b - a) / 2;
+			const record &r = at(c);
+
+			if (r.dev < k.dev || (r.dev == k.dev && r.ino < k.ino))
+				a = c + 1;
+			else
+				b = c;
+		}
+		if (a == count) return false;
+
+		const record &r = at(a);
+		if (r.dev != k.dev || r.ino != k.ino || r.meta != k.meta)
+			return false;
+
+		const uint64_t *w = reinterpret_cast<const uint64_t *>(&r + 1);
+
+		e.k = k;
+		e.has_sample = samples_valid && (r.flags & has_sample_flag);
+		e.has_full = r.flags & has_full_flag;
+		copy(w, w + h.words, e.sample.w);
+		copy(w + h.words, w + 2 * h.words, e.full.w);
+		e.sample.words = e.full.words = h.words;
+		return true;
+	}
+
+	// Appends e to packed in the format of the records of the file.
+	void pack(const entry &e, vector<uint64_t> &packed) const
+	{
+		size_t i = packed.size();
+
+		packed.resize(i + record_size() / sizeof(uint64_t));
+
+		record &r = *reinterpret_cast<record *>(&packed[i]);
+		uint64_t *w = reinterpret_cast<uint64_t *>(&r + 1);
+
+		r.ino = e.k.ino;
+		r.meta = e.k.meta;
+		r.dev = e.k.dev;
+		r.flags = (e.has_sample ? has_sample_flag : 0) |
+			(e.has_full ? has_full_flag : 0);
+		copy(e.sample.w, e.sample.w + h.words, w);
+		copy(e.full.w, e.full.w + h.words, w + h.words);
+	}
+
+	// Replaces the cache file with the packed records, merged with the
+	// records of the old file for files that were not examined, through
+	// a temporary file synced and renamed over it.
+	void save(const vector<uint64_t> &packed)
+	{
+		const size_t rw = record_size() / sizeof(uint64_t);
+		const size_t n = packed.size() / rw;
+		vector<size_t> order(n);
+
+		auto rec = [&](size_t i) -> const record & {
+			return *reinterpret_cast<const record *>(
+					&packed[i * rw]);
+		};
+		auto before = [](const record &a, const record &b) {
+			return a.dev < b.dev ||
+				(a.dev == b.dev && a.ino < b.ino);
+		};
+		auto less = [&](size_t i, size_t j) {
+			return before(rec(i), rec(j));
+		};
+
+		for (size_t i = 0; i < n; i ++) order[i] = i;
+		sort(order.begin(), order.end(), less);
+
+		// Keys should be unique already, but bisection needs them to
+		// be.
+		size_t m = 0;
+		for (size_t i = 0; i < n; i ++)
+			if (i == 0 || less(order[m - 1], order[i]))
+				order[m ++] = order[i];
+		order.resize(m);
+
+		string tmp = path + ".XXXXXX";
+		int fd = mkstemp(&tmp[0]);
+		if (fd < 0) unix_rc::error(tmp.c_str());
+
+		// mkstemp makes the file private; give it the mode fopen
+		// would have.
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+
+		FILE *f = fdopen(fd, "w");
+		if (!f) {
+			int e = errno;
+			close(fd);
+			unlink(tmp.c_str());
+			errno = e;
+			unix_rc::error(tmp.c_str());
+		}
+
+		header fh = h;
+		fh.count = 0;
+		bool ok = fwrite(&fh, sizeof(fh), 1, f) == 1;
+
+		// The old records are sorted too: merge them in, the new
+		// ones winning.  Their samples are dropped if they were taken
+		// with another prehash size.
+		vector<char> old(record_size());
+		record &r = *reinterpret_cast<record *>(old.data());
+		size_t i = 0, k = 0;
+
+		while (ok && (i < m || k < count)) {
+			const void *p;
+
+			if (k < count && (i == m || before(at(k),
+							rec(order[i])))) {
+				memcpy(old.data(), &at(k ++), record_size());
+				if (!samples_valid)
+					r.flags &= ~has_sample_flag;
+				p = old.data();
+			} else {
+				if (k < count && !before(rec(order[i]), at(k)))
+					k ++;
+				p = &rec(order[i ++]);
+			}
+			ok = fwrite(p, record_size(), 1, f) == 1;
+			fh.count ++;
+		}
+
+		ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+			fwrite(&fh, sizeof(fh), 1, f) == 1 &&
+			fflush(f) == 0 && fsync(fileno(f)) == 0;
+		if (fclose(f) != 0 || !ok) {
+			int e = errno;
+			unlink(tmp.c_str());
+			errno = e;
+			unix_rc::error(tmp.c_str());
+		}
+		if (rename(tmp.c_str(), path.c_str()) < 0) {
+			int e = errno;
+			unlink(tmp.c_str());
+			errno = e;
+			unix_rc::error(path.c_str());
+		}
+	}
+};
+
+// The hard links planned and made by a run, for --resume to finish them
+// after a crash without scanning and hashing again.  The file holds a
+// header followed by records that are only ever appended: a plan record
+// names the files of a group of duplicates, the source first, each with
+// the identity its file had when it was planned, and is synced before
+// the group is linked; a done record follows once it is.  Each record
+// ends with a checksum, so that one torn by a crash ends the journal.
+// Finishing a group again is harmless: targets already linked to the
+// source are skipped, and so are files that changed since they were
+// planned.
+class link_journal : non_copyable {
+public:
+	// What a file was when its group was planned.  The change time is
+	// left out, as linking changes the link count of the files.
+	struct identity {
+		uint64_t dev, ino, size, mtime;
+
+		bool operator==(const identity &b) const {
+			return dev == b.dev && ino == b.ino &&
+				size == b.size && mtime == b.mtime;
+		}
+
+		static identity of(const struct stat &st) {
+			identity i;
+
+			i.dev = st.st_dev;
+			i.ino = st.st_ino;
+			i.size = st.st_size;
+			i.mtime = st.st_mtim.tv_sec * 1000000000ULL +
+				st.st_mtim.tv_nsec;
+			return i;
+		}
+	};
+
+	struct group {
+		uint64_t id;
+		vector<string> names;
+		vector<identity> ids;
+	};
+
+private:
+	enum {
+		version = 1,
+		plan_record = 1,
+		done_record = 2,
+		identity_words = sizeof(identity) / sizeof(uint64_t)
+	};
+
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+	};
+
+	// Followed by words words and a checksum.  A plan record holds
+	// the number of files, then the identity and name length of each,
+	// then the names padded to a whole word.
+	struct record {
+		uint32_t type;
+		uint32_t words;
+		uint64_t group;
+	};
+
+	enum { record_words = sizeof(record) / sizeof(uint64_t) };
+
+	const string path;
+	int fd;
+	uint64_t next;
+	vector<uint64_t> pending;
+
+	// The working directory, which relative names are recorded under,
+	// so that --resume can be run from anywhere.
+	string cwd;
+
+	static uint64_t checksum(const uint64_t *w, size_t n) {
+		uint64_t h = 0;
+
+		for (size_t i = 0; i < n; i ++) {
+			h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+			h ^= h >> 29;
+		}
+		return h;
+	}
+
+	void append(uint32_t type, uint64_t id, const vector<uint64_t> &p) {
+		size_t i = pending.size();
+
+		pending.resize(i + record_words + p.size() + 1);
+
+		record &r = *reinterpret_cast<record *>(&pending[i]);
+		r.type = type;
+		r.words = p.size();
+		r.group = id;
+		copy(p.begin(), p.end(), pending.begin() + i + record_words);
+		pending.back() = checksum(&pending[i], pending.size() - i - 1);
+	}
+
+	void write_pending() {
+		const char *p = reinterpret_cast<const char *>(pending.data());
+		size_t n = pending.size() * sizeof(uint64_t);
+
+		while (n > 0) {
+			ssize_t m = write(fd, p, n);
+			if (m < 0 && errno == EINTR) continue;
+			if (m < 0) unix_rc::error(path.c_str());
+			p += m;
+			n -= m;
+		}
+		pending.clear();
+	}
+
+	// Reads the groups planned and not done into unfinished.  Returns
+	// the size of the part of the file that holds whole records, or -1
+	// with why set if it is not a journal.
+	off_t load(vector<group> &unfinished, string &why) {
+		vector<uint64_t> w;
+		int rfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+		if (rfd < 0) {
+			why = strerror(errno);
+			return -1;
+		}
+
+		unix_fd ufd(rfd);
+		struct stat st;
+		unix_rc rc = fstat(rfd, &st);
+
+		w.resize(st.st_size / sizeof(uint64_t));
+		char *p = reinterpret_cast<char *>(w.data());
+		size_t n = w.size() * sizeof(uint64_t);
+		while (n > 0) {
+			ssize_t m = read(rfd, p, n);
+			if (m < 0 && errno == EINTR) continue;
+			if (m < 0) unix_rc::error(path.c_str());
+			if (m == 0) break;
+			p += m;
+			n -= m;
+		}
+		w.resize(w.size() - n / sizeof(uint64_t));
+
+		const size_t header_words = sizeof(header) / sizeof(uint64_t);
+		const header *h = reinterpret_cast<const header *>(w.data());
+		if (w.size() < header_words ||
+				memcmp(h->magic, "FHLJOURN", 8) ||
+				h->version != version) {
+			why = "not a journal of this version";
+			return -1;
+		}
+
+		map<uint64_t, group> planned;
+		size_t i = header_words;
+
+		for (;;) {
+			if (w.size() - i < record_words + 1) break;
+
+			const record &r =
+				*reinterpret_cast<const record *>(&w[i]);
+			size_t end = i + record_words + r.words;
+			if (r.words >= w.size() - i - record_words ||
+					w[end] != checksum(&w[i], end - i))
+				break;
+
+			if (r.type == done_record) {
+				planned.erase(r.group);
+			} else if (r.type == plan_record) {
+				group &g = planned[r.group];
+
+				g.id = r.group;
+				if (!parse(&w[i + record_words], r.words, g)) {
+					planned.erase(r.group);
+					break;
+				}
+			}
+			next = max(next, r.group + 1);
+			i = end + 1;
+		}
+
+		for (auto &it: planned)
+			unfinished.push_back(move(it.second));
+		return i * sizeof(uint64_t);
+	}
+
+	static bool parse(const uint64_t *p, size_t n, group &g) {
+		if (n < 1) return false;
+
+		const size_t count = p[0];
+		const size_t names = 1 + count * (identity_words + 1);
+		if (count > n || names > n) return false;
+
+		const char *s = reinterpret_cast<const char *>(p + names);
+		size_t left = (n - names) * sizeof(uint64_t);
+
+		for (size_t k = 0; k < count; k ++) {
+			const uint64_t *f = p + 1 + k * (identity_words + 1);
+			size_t len = f[identity_words];
+
+			if (len > left) return false;
+			g.ids.push_back(*reinterpret_cast<const identity *>(f));
+			g.names.push_back(string(s, len));
+			s += len;
+			left -= len;
+		}
+		return count > 0;
+	}
+
+	void done(uint64_t id) {
+		append(done_record, id, vector<uint64_t>());
+		write_pending();
+	}
+
+	// Removes the temporary names file_utils::hard_link left linked to
+	// the source in the directories of the targets of g.
+	void roll_back(const group &g, const talk &talker) {
+		set<string> dirs;
+		string dir, base;
+
+		for (size_t i = 1; i < g.names.size(); i ++) {
+			file_utils::decompose(g.names[i], dir, base);
+			dirs.insert(dir);
+		}
+
+		for (auto &u: dirs) {
+			DIR *d = opendir(u.c_str());
+			if (!d) continue;
+
+			struct dirent *e;
+			struct stat st;
+			while ((e = readdir(d))) {
+				if (strncmp(e->d_name, ".fhlink.", 8))
+					continue;
+				if (fstatat(dirfd(d), e->d_name, &st,
+						AT_SYMLINK_NOFOLLOW) < 0 ||
+						st.st_ino != g.ids[0].ino ||
+						st.st_dev != g.ids[0].dev)
+					continue;
+				if (unlinkat(dirfd(d), e->d_name, 0) < 0)
+					talker.warning("Warning: can't remove "
+						"'%s/%s': %s", u.c_str(),
+						e->d_name, strerror(errno));
+			}
+			closedir(d);
+		}
+	}
+
+public:
+	link_journal(const string &Path) : path(Path), fd(-1), next(0) { }
+
+	virtual ~link_journal() {
+		if (fd >= 0) close(fd);
+	}
+
+	// Starts a new journal.  Fails, saying why, if the file is a journal
+	// with unfinished groups.
+	bool create(string &why) {
+		vector<group> unfinished;
+		string ignored;
+
+		if (load(unfinished, ignored) >= 0 && !unfinished.empty()) {
+			why = formatter::sprintf("%zu groups of links are "
+					"unfinished, run --resume first",
+					unfinished.size());
+			return false;
+		}
+
+		char *d = getcwd(NULL, 0);
+		if (!d) {
+			why = strerror(errno);
+			return false;
+		}
+		cwd = d;
+		free(d);
+
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+				O_APPEND | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			why = strerror(errno);
+			return false;
+		}
+
+		header h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "FHLJOURN", 8);
+		h.version = version;
+		pending.resize(sizeof(h) / sizeof(uint64_t));
+		memcpy(pending.data(), &h, sizeof(h));
+		next = 0;
+		sync();
+		return true;
+	}
+
+	// Opens the journal of an interrupted run, to be appended to, and
+	// gets the groups it left unfinished.  A torn record at its end is
+	// cut off.
+	bool resume(vector<group> &unfinished, string &why) {
+		off_t end = load(unfinished, why);
+
+		if (end < 0) return false;
+
+		fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd < 0 || ftruncate(fd, end) < 0) {
+			why = strerror(errno);
+			return false;
+		}
+		return true;
+	}
+
+	// Records a group of files to be linked to the first one, under
+	// absolute names.  The record is only written by sync.
+	group plan(const vector<string> &names) {
+		group g;
+		vector<uint64_t> p(1, names.size());
+		string s;
+		struct stat st;
+
+		g.id = next ++;
+		for (auto &u: names)
+			g.names.push_back(u[0] == '/' ? u : cwd + "/" + u);
+		for (auto &u: g.names) {
+			identity i;
+
+			if (lstat(u.c_str(), &st) < 0)
+				memset(&i, 0, sizeof(i));
+			else
+				i = identity::of(st);
+			g.ids.push_back(i);
+
+			const uint64_t *w =
+				reinterpret_cast<const uint64_t *>(&i);
+			p.insert(p.end(), w, w + identity_words);
+			p.push_back(u.size());
+			s += u;
+		}
+		size_t k = p.size();
+		p.resize(k + (s.size() + 7) / 8, 0);
+		memcpy(&p[k], s.data(), s.size());
+
+		append(plan_record, g.id, p);
+		return g;
+	}
+
+	// Writes the groups planned and waits for them to reach the disk.
+	void sync() {
+		write_pending();
+		if (fdatasync(fd) < 0)
+			unix_rc::error(path.c_str());
+	}
+
+	// Links the files of g, planned and synced, to its first one, if it
+	// did not change since, and records that it was.  With Roll_back,
+	// temporary names left by an interrupted run are removed first.
+	void finish(const group &g, mode_t chmod_clear, bool Roll_back,
+			tickable &pg, const talk &talker)
+	{
+		const string &source = g.names[0];
+		struct stat st;
+
+		if (lstat(source.c_str(), &st) < 0 ||
+				!(identity::of(st) == g.ids[0])) {
+			talker.warning("Skipping: '%s' changed since it "
+					"was checked", source.c_str());
+			pg.occupied();
+			done(g.id);
+			return;
+		}
+
+		const mode_t mode = st.st_mode;
+		vector<string> targets;
+
+		if (Roll_back)
+			roll_back(g, talker);
+
+		for (size_t i = 1; i < g.names.size(); i ++) {
+			const char *t = g.names[i].c_str();
+
+			if (lstat(t, &st) < 0) {
+				talker.warning("Warning: can't stat '%s': %s",
+						t, strerror(errno));
+				pg.occupied();
+				continue;
+			}
+
+			identity d = identity::of(st);
+			if (d.dev == g.ids[0].dev && d.ino == g.ids[0].ino)
+				continue;
+			if (!(d == g.ids[i])) {
+				talker.warning("Skipping: '%s' changed since "
+						"it was checked", t);
+				pg.occupied();
+				continue;
+			}
+			targets.push_back(g.names[i]);
+		}
+
+		file_utils::hard_link(source, targets, pg, talker);
+
+		if (chmod_clear && chmod(source.c_str(),
+					mode & 07777 & ~chmod_clear) < 0) {
+			talker.warning("Warning: can't chmod '%s': %s",
+					source.c_str(), strerror(errno));
+			pg.occupied();
+		}
+		done(g.id);
+	}
+};
+
+class filename_filter {
+public:
+	virtual ~filename_filter() { }
+	virtual bool accept(const char *u) = 0;
+};
+
+class all_filenames : public filename_filter {
+public:
+	all_filenames() { }
+	virtual ~all_filenames() { }
+	bool accept(const char *u) { return true; }
+};
+
+class fnmatch_filter : public filename_filter {
+	const vector<string> &patterns;
+
+public:
+	fnmatch_filter(const vector<string> &Patterns) :
+		patterns(Patterns)
+	{
+	}
+	virtual ~fnmatch_filter() { }
+	bool accept(const char *u) {
+		for (auto &p: patterns) {
+			if (fnmatch(p.c_str(), u, 0) == 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+all_filenames all_filenames_singleton;
+
+// Splits files of the same size into classes of identical contents.  All
+// the files are read block by block in lockstep and each class is split
+// as soon as its members' blocks differ, so every file is read at most
+// once however large the group, and a file drops out as soon as it
+// matches no other.  Files that cannot be read are left out of all
+// classes, with a message in errors().
+//
+// Blocks start small, so that files differing near their head are told
+// apart cheaply, and double up to a size that keeps the whole group within
+// the memory budget.  After each block, the kernel is asked to read the
+// next one ahead while the blocks are compared.
+class lockstep_comparator : non_copyable
+{
+	enum {
+		max_block_size = 512 * 1024,
+		min_block_size = 4096,
+		first_block_size = 16 * 1024,
+		// Bytes of buffers for a whole group
+		memory_budget = 32 * 1024 * 1024,
+		// Fewest descriptors a comparator keeps open
+		min_open = 16
+	};
+
+	typedef vector<unsigned> group;
+
+	const vector<string> &names;
+	block_arena &arena;
+	io_policy &io;
+	tickable *tck;
+	bool mapped;
+	size_t block_size, last_block_size;
+
+	// The files of live classes stay open, up to max_open of them;
+	// the others are reopened for every block.
+	unsigned max_open, open_count;
+	vector<int> fds;
+	vector<bool> failed;
+	vector<string> messages;
+	vector<io_policy::cursor> cursors;
+
+	// With --io mmap, the window of each file and its size
+	vector<mapped_io::window> windows;
+	vector<off_t> sizes;
+
+	// The classes being compared, the next ones and the finished ones
+	vector<group> active, next, done;
+	vector<group> parts;
+	vector<const uint8_t *> rep;
+	vector<ssize_t> len;
+
+	lockstep_comparator();
+	lockstep_comparator(const lockstep_comparator&);
+	lockstep_comparator &operator=(const lockstep_comparator&);
+
+	void fail(unsigned i, const char *what)
+	{
+		failed[i] = true;
+		messages.push_back(string("Can't compare '") + names[i] +
+				"': " + what);
+	}
+
+	// Opens file i unless it is kept open, or returns -1.  It is kept
+	// open while there are descriptors to spare.
+	int file(unsigned i)
+	{
+		int fd = fds[i];
+		if (fd >= 0) return fd;
+
+		fd = io.open(names[i].c_str());
+		if (fd < 0) {
+			fail(i, strerror(errno));
+		} else if (open_count < max_open) {
+			fds[i] = fd;
+			open_count ++;
+		}
+		return fd;
+	}
+
+	// Closes file i once it has left the live classes.
+	void drop(unsigned i)
+	{
+		if (fds[i] < 0) return;
+		close(fds[i]);
+		fds[i] = -1;
+		open_count --;
+	}
+
+	void release(unsigned i, int fd)
+	{
+		if (fd != fds[i]) close(fd);
+	}
+
+	// Reads the block of file i at offset into b, returning its length
+	// or -1 if the file could not be read.
+	ssize_t read_block(unsigned i, off_t offset, uint8_t *b)
+	{
+		int fd = file(i);
+		if (fd < 0) return -1;
+
+		ssize_t n = io.read(fd, b, block_size, offset);
+		if (n < 0) {
+			fail(i, strerror(errno));
+		} else if (n < ssize_t(block_size)) {
+			cursors[i].finish(io, fd, offset + n, true);
+		} else {
+			cursors[i].advance(io, fd, offset + n);
+			io.ahead(fd, offset + n, next_block_size());
+		}
+		release(i, fd);
+		return n;
+	}
+
+	// Moves the cursor of file i, open on fd if not -1, to offset, or
+	// finishes it there if last is set.
+	void leave(unsigned i, off_t offset, bool last, int fd=-1)
+	{
+		if (!io.drops()) return;
+		if (fd < 0) fd = fds[i];
+
+		// Only a descriptor opened here is closed here.
+		int own = -1;
+		if (fd < 0 && (fd = own = io.open(names[i].c_str())) < 0)
+			return;
+
+		if (last)
+			cursors[i].finish(io, fd, offset, false);
+		else
+			cursors[i].advance(io, fd, offset);
+		if (own >= 0) close(own);
+	}
+
+	// Unmaps the window of file i, open on fd if not -1, leaving its
+	// pages behind, up to end if not -1.
+	void unmap(unsigned i, bool last, off_t end=-1, int fd=-1)
+	{
+		mapped_io::window &w = windows[i];
+
+		if (end < 0) end = w.offset() + w.bytes();
+		w.unmap();
+		leave(i, end, last, fd);
+	}
+
+	// Points p at the block of file i at offset, mapping the window
+	// holding it if needed, and returns its length or -1.
+	ssize_t map_block(unsigned i, off_t offset, const uint8_t *&p)
+	{
+		mapped_io::window &w = windows[i];
+		ssize_t n = 0;
+		int fd = -1;
+
+		if (sizes[i] < 0) {
+			struct stat st;
+
+			fd = file(i);
+			if (fd < 0) return -1;
+			if (fstat(fd, &st) < 0) {
+				fail(i, strerror(errno));
+				release(i, fd);
+				return -1;
+			}
+			sizes[i] = st.st_size;
+		}
+
+		n = max(off_t(0), min(off_t(block_size), sizes[i] - offset));
+		p = reinterpret_cast<const uint8_t *>("");
+		if (n && w.covers(offset, n)) {
+			p = w.at(offset);
+		} else if (n) {
+			if (fd < 0) fd = file(i);
+			if (fd < 0) return -1;
+			unmap(i, false, -1, fd);
+			p = w.map(fd, offset, min(
+					off_t(mapped_io::window_size),
+					sizes[i] - offset));
+			if (!p) {
+				fail(i, strerror(errno));
+				n = -1;
+			}
+		}
+
+		if (fd >= 0) release(i, fd);
+		return n;
+	}
+
+	// Points p at the block of file i at offset, read into b or mapped,
+	// and returns its length, or -1 if the file could not be read.
+	ssize_t block(unsigned i, off_t offset, uint8_t *b, const uint8_t *&p)
+	{
+		if (failed[i]) return -1;
+
+		ssize_t n;
+		if (mapped) {
+			n = map_block(i, offset, p);
+			if (n > 0) io.mapped_read(n);
+		} else {
+			n = read_block(i, offset, b);
+			p = b;
+		}
+
+		if (tck && n > 0) tck->tick(n);
+		return n;
+	}
+
+	// Splits class g on its blocks at offset, into next if they were
+	// full and into done if they were the last.
+	void split(const group &g, off_t offset)
+	{
+		uint8_t *b = mapped ? NULL : arena.get(g.size() * block_size);
+
+		parts.clear();
+		rep.clear();
+		len.clear();
+
+		for (unsigned k = 0; k < g.size(); k ++) {
+			const uint8_t *p;
+			ssize_t n = block(g[k], offset, b + k * block_size, p);
+			if (n < 0) {
+				drop(g[k]);
+				continue;
+			}
+
+			unsigned j = 0;
+			while (j < parts.size() &&
+				(len[j] != n || memcmp(rep[j], p, n)))
+				j ++;
+			if (j == parts.size()) {
+				parts.resize(j + 1);
+				rep.push_back(p);
+				len.push_back(n);
+			}
+			parts[j].push_back(g[k]);
+		}
+
+		for (unsigned j = 0; j < parts.size(); j ++) {
+			bool last = len[j] < ssize_t(block_size);
+
+			if (parts[j].size() > 1 && !last) {
+				next.push_back(parts[j]);
+				continue;
+			}
+			if (parts[j].size() > 1)
+				done.push_back(parts[j]);
+
+			// The files of singletons and finished classes are
+			// not read again.
+			for (unsigned i: parts[j]) {
+				if (mapped)
+					unmap(i, true, offset + len[j]);
+				else if (!last)
+					leave(i, offset + len[j], true);
+				drop(i);
+			}
+		}
+	}
+
+	// Splits class g, failing the files whose mapping raises SIGBUS
+	// because they were truncated, and starting over without them.
+	void split_guarded(const group &g, off_t offset)
+	{
+		sigjmp_buf jb;
+
+		if (sigsetjmp(jb, 0)) {
+			mapped_io::guard = NULL;
+
+			bool found = false;
+			for (unsigned i: g) {
+				if (!windows[i].contains(
+						mapped_io::fault_address))
+					continue;
+				windows[i].unmap();
+				fail(i, "File truncated while mapped");
+				found = true;
+			}
+			if (!found)
+				for (unsigned i: g)
+					if (!failed[i])
+						fail(i, "Bus error");
+
+			split_guarded(g, offset);
+			return;
+		}
+
+		mapped_io::guard = &jb;
+		split(g, offset);
+		mapped_io::guard = NULL;
+	}
+
+	size_t next_block_size() const {
+		return min(2 * block_size, last_block_size);
+	}
+
+public:
+	lockstep_comparator(const vector<string> &Names, block_arena &Arena,
+			io_policy &Io, unsigned Max_open, tickable *Tck=NULL) :
+		names(Names),
+		arena(Arena),
+		io(Io),
+		tck(Tck),
+		mapped(Io.is_mapped()),
+		max_open(Max_open),
+		open_count(0),
+		fds(Names.size(), -1),
+		failed(Names.size(), false),
+		cursors(Names.size()),
+		windows(mapped ? Names.size() : 0),
+		sizes(Names.size(), -1)
+	{
+		size_t m = max(names.size(), size_t(1));
+		last_block_size = memory_budget / m &
+			~size_t(min_block_size - 1);
+		last_block_size = max(size_t(min_block_size),
+				min(size_t(max_block_size), last_block_size));
+		block_size = min(size_t(first_block_size), last_block_size);
+	}
+
+	virtual ~lockstep_comparator()
+	{
+		for (int fd: fds)
+			if (fd >= 0) close(fd);
+	}
+
+	// The classes of at least two identical files, as indices into the
+	// names, each in increasing order and ordered by their first member.
+	vector< vector<unsigned> > classes()
+	{
+		active.assign(1, group());
+		done.clear();
+
+		for (unsigned i = 0; i < names.size(); i ++)
+			active[0].push_back(i);
+
+		for (off_t offset = 0; !active.empty(); ) {
+			next.clear();
+			for (auto &g: active) {
+				if (mapped)
+					split_guarded(g, offset);
+				else
+					split(g, offset);
+			}
+
+			active.swap(next);
+			offset += block_size;
+			block_size = next_block_size();
+		}
+
+		// Every file has left by now, but those that failed may
+		// still be mapped.
+		for (auto &w: windows)
+			w.unmap();
+
+		sort(done.begin(), done.end());
+		return done;
+	}
+
+	const vector<string> &errors() const { return messages; }
+
+	// The descriptors each of n comparators running at once may keep
+	// open: half of RLIMIT_NOFILE, once its soft limit is raised to
+	// the hard one, leaving the rest to hashing and the cache.
+	static unsigned open_budget(unsigned n)
+	{
+		struct rlimit rl;
+		rlim_t m = 1024;
+
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			rlim_t soft = rl.rlim_cur;
+			rl.rlim_cur = rl.rlim_max;
+			if (soft < rl.rlim_max &&
+					setrlimit(RLIMIT_NOFILE, &rl) < 0)
+				rl.rlim_cur = soft;
+			m = rl.rlim_cur;
+		}
+
+		m = min(m, rlim_t(1) << 20) / 2 / max(n, 1u);
+		return max(m, rlim_t(min_open));
+	}
+};
+
+class trie {
+	bool terminal;
+	typedef map<char, trie> dictionary;
+	dictionary entries;
 
 public:
 	trie() : terminal(false) { }
@@ -869,46 +3406,801 @@ public:
 	}
 };
 
-class collector : non_copyable {
-	typedef forward_list<file_info*> file_infos;
-	typedef map< file_key, forward_list<file_info> > key_map;
-	typedef map< file_id, file_infos > id_map;
-	key_map key_collection;
-	id_map id_collection;
-	path current;
+// The part of struct stat the traversal cares about.
+struct entry_stat {
+	dev_t dev;
+	ino_t ino;
+	mode_t mode;
+	off_t size;
+
+	entry_stat() { }
+
+	entry_stat(const struct stat &st) :
+		dev(st.st_dev),
+		ino(st.st_ino),
+		mode(st.st_mode),
+		size(st.st_size)
+	{ }
+};
+
+// A run of directory entries read in one go, so that they can be
+// stat'ed together.
+class dir_batch : non_copyable {
+	vector<char> names;
+
+public:
+	struct entry {
+		size_t name;
+		unsigned char type;
+		ino_t d_ino;
+		int err;
+		entry_stat st;
+	};
+
+private:
+	struct by_inode {
+		bool operator()(const entry &a, const entry &b) const {
+			return a.d_ino < b.d_ino;
+		}
+	};
+
+public:
+
+	vector<entry> entries;
+
+	// Reads up to max entries, skipping . and ..  Returns false once
+	// the directory is exhausted.
+	bool read(unix_dir &d, size_t max) {
+		const struct dirent *e;
+
+		names.clear();
+		entries.clear();
+
+		while (entries.size() < max && d.read(e)) {
+			if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+				continue;
+
+			size_t m = strlen(e->d_name);
+			entry en;
+			en.name = names.size();
+			en.type = e->d_type;
+			en.d_ino = e->d_ino;
+			en.err = 0;
+			names.insert(names.end(), e->d_name, e->d_name + m + 1);
+			entries.push_back(en);
+		}
+
+		return !entries.empty();
+	}
+
+	const char *name(const entry &e) const {
+		return &names[e.name];
+	}
+
+	// Inode tables are laid out in inode order on most filesystems,
+	// so stat'ing in that order avoids seeking back and forth.
+	void sort_by_inode() {
+		stable_sort(entries.begin(), entries.end(), by_inode());
+	}
+};
+
+class stat_engine : non_copyable {
+public:
+	enum { batch_size = 256 };
+
+	virtual ~stat_engine() { }
+
+	// Stats all the entries of b, relative to the directory open on at.
+	virtual void stat_all(int at, dir_batch &b) = 0;
+};
+
+class sync_stat_engine : public stat_engine {
+public:
+	sync_stat_engine() { }
+	virtual ~sync_stat_engine() { }
+
+	void stat_all(int at, dir_batch &b) {
+		struct stat st;
+
+		for (auto &e: b.entries) {
+			int rc = file_utils::stat_entry(at, b.name(e), e.type,
+					st);
+			e.err = rc < 0 ? errno : 0;
+			if (!e.err) e.st = st;
+		}
+	}
+};
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX)
+// Bare-bones io_uring submission and completion rings.
+class uring : non_copyable {
+	int fd;
+	unsigned n_entries;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned local_tail;
+
+	void *map(size_t size, off_t offset) {
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, offset);
+		if (p == MAP_FAILED) {
+			int e = errno;
+			release();
+			errno = e;
+			unix_rc::error("io_uring mmap");
+		}
+		return p;
+	}
+
+	void release() {
+		if (sqes) munmap(sqes, sqes_size);
+		if (cq_ring) munmap(cq_ring, cq_ring_size);
+		if (sq_ring) munmap(sq_ring, sq_ring_size);
+		close(fd);
+	}
+
+	template<class T>
+	static T *at(void *base, unsigned offset) {
+		return reinterpret_cast<T *>(
+				reinterpret_cast<char *>(base) + offset);
+	}
+
+public:
+	explicit uring(unsigned Entries) :
+		sq_ring(NULL),
+		cq_ring(NULL),
+		sqes(NULL)
+	{
+		struct io_uring_params p;
+
+		memset(&p, 0, sizeof(p));
+		fd = syscall(__NR_io_uring_setup, Entries, &p);
+		if (fd < 0) unix_rc::error("io_uring_setup");
+
+		n_entries = p.sq_entries;
+		sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+		sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+		sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+		cq_ring = map(cq_ring_size, IORING_OFF_CQ_RING);
+		sqes = reinterpret_cast<struct io_uring_sqe *>(
+				map(sqes_size, IORING_OFF_SQES));
+
+		sq_head = at<unsigned>(sq_ring, p.sq_off.head);
+		sq_tail = at<unsigned>(sq_ring, p.sq_off.tail);
+		sq_mask = at<unsigned>(sq_ring, p.sq_off.ring_mask);
+		sq_array = at<unsigned>(sq_ring, p.sq_off.array);
+		cq_head = at<unsigned>(cq_ring, p.cq_off.head);
+		cq_tail = at<unsigned>(cq_ring, p.cq_off.tail);
+		cq_mask = at<unsigned>(cq_ring, p.cq_off.ring_mask);
+		cqes = at<struct io_uring_cqe>(cq_ring, p.cq_off.cqes);
+		local_tail = *sq_tail;
+	}
+
+	virtual ~uring() {
+		release();
+	}
+
+	unsigned size() const { return n_entries; }
+
+	bool supports(unsigned op) {
+		const unsigned n_ops = 256;
+		vector<char> buffer(sizeof(struct io_uring_probe) +
+				n_ops * sizeof(struct io_uring_probe_op));
+		struct io_uring_probe *pr =
+			reinterpret_cast<struct io_uring_probe *>(&buffer[0]);
+
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+					pr, n_ops) < 0)
+			return false;
+		return op <= pr->last_op &&
+			(pr->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	// Returns a cleared submission entry, or NULL if the ring is full.
+	struct io_uring_sqe *next() {
+		unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (local_tail - head >= n_entries) return NULL;
+
+		unsigned i = local_tail & *sq_mask;
+		sq_array[i] = i;
+		local_tail ++;
+		memset(&sqes[i], 0, sizeof(sqes[i]));
+		return &sqes[i];
+	}
+
+	// Submits the queued entries and waits for n completions.
+	void submit(unsigned n) {
+		__atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+
+		while (true) {
+			unsigned head = __atomic_load_n(sq_head,
+					__ATOMIC_ACQUIRE);
+			int rc = syscall(__NR_io_uring_enter, fd,
+					local_tail - head, n,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+			if (rc >= 0) return;
+			if (errno != EINTR) unix_rc::error("io_uring_enter");
+		}
+	}
+
+	bool pop(struct io_uring_cqe &c) {
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+		c = cqes[head & *cq_mask];
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+// Submits the statx calls of a whole batch at once.
+class uring_stat_engine : public stat_engine {
+	uring ring;
+	vector<struct statx> sx;
+
+public:
+	uring_stat_engine() : ring(batch_size) {
+		if (!ring.supports(IORING_OP_STATX))
+			throw runtime_error("io_uring does not support statx");
+	}
+
+	virtual ~uring_stat_engine() { }
+
+	void stat_all(int at, dir_batch &b) {
+		const size_t n = b.entries.size();
+		size_t i = 0;
+
+		sx.resize(n);
+
+		while (i < n) {
+			unsigned queued = 0;
+			struct io_uring_sqe *sqe;
+
+			for (; i < n && queued < ring.size(); i ++) {
+				dir_batch::entry &e = b.entries[i];
+
+				e.err = 0;
+				if (!file_utils::needs_stat(e.type)) {
+					e.st.mode = 0;
+					continue;
+				}
+
+				sqe = ring.next();
+				assert(sqe != NULL);
+				sqe->opcode = IORING_OP_STATX;
+				sqe->fd = at;
+				sqe->addr = reinterpret_cast<uintptr_t>(
+						b.name(e));
+				sqe->len = file_utils::statx_mask(e.type);
+				sqe->off = reinterpret_cast<uintptr_t>(&sx[i]);
+				sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+				sqe->user_data = i;
+				queued ++;
+			}
+
+			while (queued > 0) {
+				struct io_uring_cqe c;
+				struct stat st;
+
+				ring.submit(queued);
+				while (queued > 0 && ring.pop(c)) {
+					dir_batch::entry &e =
+						b.entries[c.user_data];
+					if (c.res < 0) {
+						e.err = -c.res;
+					} else {
+						file_utils::from_statx(
+							sx[c.user_data], st);
+						e.st = st;
+					}
+					queued --;
+				}
+			}
+		}
+	}
+};
+#endif
+
+// Returns an io_uring engine if asked for and available, otherwise a
+// synchronous one.  why is set to the reason io_uring was not used.
+static stat_engine *new_stat_engine(bool use_uring, string &why)
+{
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX)
+	if (use_uring) {
+		try {
+			return new uring_stat_engine;
+		}
+		catch(exception &e) {
+			why = e.what();
+		}
+	}
+#else
+	why = "io_uring support not compiled in";
+#endif
+	return new sync_stat_engine;
+}
+
+// Reads the next batch of entries to stat from d.  In inode order, the
+// whole directory is read at once and sorted.
+static bool read_batch(unix_dir &d, dir_batch &b, bool inode_order)
+{
+	if (!inode_order)
+		return b.read(d, stat_engine::batch_size);
+
+	if (!b.read(d, SIZE_MAX))
+		return false;
+	b.sort_by_inode();
+	return true;
+}
+
+struct dir_listing : non_copyable {
+	struct entry {
+		string_pool::handle name;
+		dev_t dev;
+		ino_t ino;
+		mode_t mode;
+		off_t size;
+	};
+
+	string_pool sp;
+	vector<entry> entries;
+	off_t other_count;
+
+	dir_listing() : other_count(0) { }
+};
+
+// Scans directories on several threads.  Each directory is a work item;
+// workers pop from the back of their own deque and steal from the front
+// of the others'.  Scanning only records what was found: the listings
+// are replayed in depth-first order by the collector afterwards, so that
+// the result does not depend on the scheduling, and each is freed once it
+// has been replayed.  Workers that find nothing to do sleep until a
+// directory is pushed or the walk is over.
+class parallel_walker : non_copyable {
+	// A scanned directory whose subdirectories are queued.  It stays
+	// open until they have all been opened relative to it, so that the
+	// kernel does not resolve their whole paths; if no descriptor was
+	// left to keep it open, fd is -1 and they are opened by path.
+	struct parent_dir : non_copyable {
+		int fd;
+		string path;
+
+		parent_dir(int Fd, const string &Path) : fd(Fd), path(Path) { }
+
+		virtual ~parent_dir() {
+			if (fd >= 0) close(fd);
+		}
+	};
+
+	// A directory to scan: the root, named by path, or a name in a
+	// parent.
+	struct work {
+		shared_ptr<parent_dir> parent;
+		string name;
+		dir_listing *listing;
+
+		string path() const {
+			return parent ? parent->path + name : name;
+		}
+	};
+
+	struct work_queue {
+		mutex m;
+		deque<work> q;
+	};
+
+	typedef map< file_key, unique_ptr<dir_listing> > listing_map;
+
+	const unsigned n_workers;
+	bool use_uring;
+	bool inode_order;
+	off_t min_size;
+	filename_filter &dir_filter;
+	const talk &talker;
+	progress &pg;
+	unique_ptr<work_queue[]> queues;
+	mutex listings_mutex;
+	listing_map listings;
+	mutex talk_mutex;
+	mutex idle_mutex;
+	condition_variable idle_cv;
+	atomic<long> pending;
+	atomic<long> queued;
+	atomic<uint64_t> eligible;
+
+public:
+	parallel_walker(
+			unsigned N_workers,
+			bool Use_uring,
+			bool Inode_order,
+			off_t Min_size,
+			filename_filter &Dir_filter,
+			const talk &Talker,
+			progress &Pg
+		) :
+			n_workers(N_workers),
+			use_uring(Use_uring),
+			inode_order(Inode_order),
+			min_size(Min_size),
+			dir_filter(Dir_filter),
+			talker(Talker),
+			pg(Pg),
+			queues(new work_queue[N_workers]),
+			pending(0),
+			queued(0),
+			eligible(0)
+	{
+	}
+
+	virtual ~parallel_walker() { }
+
+	// Returns a fresh listing for the given directory, or NULL if
+	// another occurrence of it has already been claimed.
+	dir_listing *claim(const file_key &fk) {
+		lock_guard<mutex> lock(listings_mutex);
+		unique_ptr<dir_listing> &l = listings[fk];
+		if (l) return NULL;
+		l.reset(new dir_listing);
+		return l.get();
+	}
+
+	// Hands over the listing of the given directory, or NULL if it was
+	// not scanned or has already been taken.
+	unique_ptr<dir_listing> take(const file_key &fk) {
+		unique_ptr<dir_listing> l;
+		auto it = listings.find(fk);
+		if (it == listings.end()) return l;
+		l = move(it->second);
+		listings.erase(it);
+		return l;
+	}
+
+	void walk(const string &root, dir_listing *l) {
+		push(0, shared_ptr<parent_dir>(), root, l);
+
+		// Workers steal from every queue, so the walk carries on
+		// with those that could be started, or on this thread if
+		// none could.
+		vector<thread> workers;
+		try {
+			for (unsigned w = 0; w < n_workers; w ++)
+				workers.push_back(thread(
+						&parallel_walker::worker,
+						this, w));
+		} catch(exception &e) {
+			{
+				lock_guard<mutex> lock(talk_mutex);
+				talker.warning("Warning: started %zu of %u "
+						"walker threads: %s",
+						workers.size(), n_workers,
+						e.what());
+				pg.occupied();
+			}
+			if (workers.empty())
+				worker(0);
+		}
+
+		uint64_t shown = 0;
+		for (bool over = false; !over; ) {
+			{
+				unique_lock<mutex> lock(idle_mutex);
+				over = idle_cv.wait_for(lock,
+					chrono::milliseconds(50),
+					[this] { return pending == 0; });
+			}
+			uint64_t n = eligible;
+			lock_guard<mutex> lock(talk_mutex);
+			pg.tick(n - shown);
+			shown = n;
+		}
+
+		for (auto &t: workers)
+			t.join();
+	}
+
+private:
+	void push(unsigned w, const shared_ptr<parent_dir> &parent,
+			const string &name, dir_listing *l) {
+		work wk;
+		wk.parent = parent;
+		wk.name = name;
+		wk.listing = l;
+		pending ++;
+		{
+			lock_guard<mutex> lock(queues[w].m);
+			queues[w].q.push_back(wk);
+		}
+		queued ++;
+		wake(false);
+	}
+
+	// Wakes one idle worker, or everyone once the walk is over.  The
+	// mutex is taken so that a worker about to wait cannot miss it.
+	void wake(bool all) {
+		{
+			lock_guard<mutex> lock(idle_mutex);
+		}
+		if (all)
+			idle_cv.notify_all();
+		else
+			idle_cv.notify_one();
+	}
+
+	bool pop(unsigned w, work &wk) {
+		{
+			work_queue &own = queues[w];
+			lock_guard<mutex> lock(own.m);
+			if (!own.q.empty()) {
+				wk = own.q.back();
+				own.q.pop_back();
+				queued --;
+				return true;
+			}
+		}
+
+		for (unsigned i = 1; i < n_workers; i ++) {
+			work_queue &victim = queues[(w + i) % n_workers];
+			lock_guard<mutex> lock(victim.m);
+			if (!victim.q.empty()) {
+				wk = victim.q.front();
+				victim.q.pop_front();
+				queued --;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void warning(const char *fmt, const char *u, const char *v) {
+		lock_guard<mutex> lock(talk_mutex);
+		talker.warning(fmt, u, v);
+		pg.occupied();
+	}
+
+	void scan(unsigned w, stat_engine &engine, const work &wk) {
+		dir_listing &l = *wk.listing;
+		shared_ptr<parent_dir> self;
+		const string path = wk.path();
+		string base = path;
+		dir_batch b;
+
+		if (base.empty() || base[base.size() - 1] != '/')
+			base += '/';
+
+		int at = AT_FDCWD;
+		const char *name = path.c_str();
+		if (wk.parent && wk.parent->fd >= 0) {
+			at = wk.parent->fd;
+			name = wk.name.c_str();
+		}
+		unix_dir d(at, name);
+
+		while (read_batch(d, b, inode_order)) {
+			engine.stat_all(d.fd(), b);
+			for (auto &e: b.entries)
+				scan_entry(w, l, d, self, base, b.name(e),
+						e.err, e.st);
+		}
+	}
+
+	void scan_entry(unsigned w, dir_listing &l, const unix_dir &d,
+			shared_ptr<parent_dir> &self, const string &base,
+			const char *name, int err, const entry_stat &st)
+	{
+		if (err) {
+			string u = base + name;
+			warning("Warning: Cannot stat '%s': %s\n",
+					u.c_str(), strerror(err));
+			return;
+		}
+
+		bool is_dir = S_ISDIR(st.mode);
+		bool is_eligible_file =
+			S_ISREG(st.mode) && st.size >= min_size;
+
+		if (!is_dir && !is_eligible_file) {
+			l.other_count ++;
+			return;
+		}
+
+		dir_listing::entry en;
+		en.name = l.sp.add(name);
+		en.dev = st.dev;
+		en.ino = st.ino;
+		en.mode = st.mode;
+		en.size = st.size;
+		l.entries.push_back(en);
+
+		if (is_eligible_file) {
+			eligible ++;
+		} else if (dir_filter.accept(name)) {
+			dir_listing *sub =
+				claim(file_key(st.dev, st.ino));
+			if (!sub) return;
+			if (!self)
+				self.reset(new parent_dir(fcntl(d.fd(),
+						F_DUPFD_CLOEXEC, 0), base));
+			push(w, self, name, sub);
+		}
+	}
+
+	void worker(unsigned w) {
+		work wk;
+		string why;
+		unique_ptr<stat_engine> engine(new_stat_engine(use_uring, why));
+
+		while (pending > 0) {
+			if (!pop(w, wk)) {
+				unique_lock<mutex> lock(idle_mutex);
+				idle_cv.wait(lock, [this] {
+					return queued > 0 || pending == 0;
+				});
+				continue;
+			}
+
+			try {
+				scan(w, *engine, wk);
+			}
+			catch(exception &e) {
+				warning("While collecting %s: %s",
+						wk.path().c_str(), e.what());
+			}
+			wk.parent.reset();
+			if (-- pending == 0)
+				wake(true);
+		}
+	}
+};
+
+// Stable LSD radix sort of v on the 64-bit key returned by key, one byte
+// at a time.  The histograms of all the bytes are computed in one pass,
+// and bytes that are the same for all elements cost nothing more.
+template<class T, class K>
+static void radix_sort(vector<T> &v, K key)
+{
+	const size_t n = v.size();
+	vector< array<size_t, 256> > count(8);
+
+	for (auto &c: count) c.fill(0);
+	for (auto &x: v) {
+		uint64_t k = key(x);
+		for (unsigned d = 0; d < 8; d ++)
+			count[d][(k >> (8 * d)) & 255] ++;
+	}
+
+	vector<T> w(n);
+
+	for (unsigned d = 0; d < 8; d ++) {
+		array<size_t, 256> &c = count[d];
+		size_t total = 0;
+		bool trivial = false;
+
+		for (auto &b: c) {
+			if (b == n) trivial = true;
+			size_t t = b;
+			b = total;
+			total += t;
+		}
+		if (trivial) continue;
+
+		for (auto &x: v)
+			w[c[(key(x) >> (8 * d)) & 255] ++] = x;
+		v.swap(w);
+	}
+}
+
+// How many files and bytes went into a stage of the check phase, and how
+// many of them it showed to have no duplicate.
+struct stage_counter {
+	const char *name;
+	off_t files, bytes;
+	off_t eliminated_files, eliminated_bytes;
+
+	stage_counter(const char *Name) :
+		name(Name),
+		files(0),
+		bytes(0),
+		eliminated_files(0),
+		eliminated_bytes(0)
+	{ }
+
+	void in(size_t m, off_t size) {
+		files += m;
+		bytes += m * size;
+	}
+
+	void eliminated(size_t m, off_t size) {
+		eliminated_files += m;
+		eliminated_bytes += m * size;
+	}
+
+	void add(const stage_counter &b) {
+		files += b.files;
+		bytes += b.bytes;
+		eliminated_files += b.eliminated_files;
+		eliminated_bytes += b.eliminated_bytes;
+	}
+
+	void show(const talk &talker) const {
+		talker.info("Stage %s: %zd files (%zd bytes) checked, "
+				"%zd files (%zd bytes) eliminated",
+				name, files, bytes,
+				eliminated_files, eliminated_bytes);
+	}
+};
+
+class collector : non_copyable {
+	typedef vector<file_index> file_infos;
+
+	// An eligible file, to be grouped with the others of the same size
+	// and device by sorting once collection is over.
+	struct size_entry {
+		off_t size;
+		file_index fi;
+		uint16_t dev;
+	};
+
+	file_store nodes;
+	inode_index key_collection;
+	vector<size_entry> id_collection;
 	progress pg;
 	off_t min_size;
 	const int hash_iterations;
-	file_info dummy;
 	off_t saveable_space;
-	vector < pair< file_id, vector <file_info *> > > dupes;
+	vector < pair< file_id, file_infos > > dupes;
 	filename_filter &dir_filter;
 	off_t ignored_dir_count, file_count, hard_link_count,
 	      eligible_file_count,
 	      duplicate_count;
 	off_t eligible_byte_count;
+	off_t prehash_size;
+	const string hash_name;
+	bool trust_hash;
+	io_policy io;
+	unsigned device_reads;
+	unique_ptr<hash_cache> cache;
 	bool verbose;
 	bool exact;
 	mode_t chmod_clear;
 	bool debug;
+	unsigned threads;
+	unsigned compare_fds;
+	bool use_uring;
+	bool inode_order;
+	bool physical_order;
+	bool reflink;
+	class link_stream;
+	unique_ptr<link_stream> stream;
+	unique_ptr<link_journal> journal;
+	unique_ptr<stat_engine> engine;
 	string_pool sp;
+	path_builder paths;
 
 	struct file_info_string : public lazy_string {
-		const string_pool &sp;
-		file_info *fi;
+		path_builder &paths;
+		file_index fi;
 		string p;
 
-		file_info_string(const string_pool &Sp) :
-			sp(Sp), fi(NULL)
+		file_info_string(path_builder &Paths) :
+			paths(Paths), fi(no_file)
 		{
 		}
 
 		const char *get() {
-			if (fi == NULL) return "";
-			p = fi->get_path(sp);
+			if (fi == no_file) return "";
+			p = paths.get(fi);
 			return p.c_str();
 		}
-		void set(file_info *Fi) { fi = Fi; }
+		void set(file_index Fi) { fi = Fi; }
 	};
 
 	file_info_string fis;
@@ -918,13 +4210,26 @@ public:
 	collector(
 			off_t Min_size,
 			int Hash_iterations,
+			off_t Prehash_size,
+			const string &Hash_name,
+			const string &Cache_path,
+			const string &Io_mode,
+			bool Drop_cache,
 			filename_filter& Dir_filter,
 			bool Exact,
 			mode_t Chmod_clear,
 			bool Debug,
 			bool Progress,
+			unsigned Threads,
+			unsigned Device_reads,
+			bool Use_uring,
+			bool Inode_order,
+			bool Physical_order,
+			bool Reflink,
+			bool Huge_pages,
 			const talk &Talker
 		) :
+			key_collection(nodes),
 			pg(stderr, fis, 0, Progress),
 			min_size(Min_size),
 			hash_iterations(Hash_iterations),
@@ -936,355 +4241,1512 @@ public:
 			eligible_file_count(0),
 			duplicate_count(0),
 			eligible_byte_count(0),
+			prehash_size(Prehash_size),
+			hash_name(Hash_name),
+			trust_hash(unique_ptr<hash_engine>(
+					new_hash_engine(Hash_name))->strong()),
+			io(Io_mode, Drop_cache),
+			device_reads(Device_reads),
 			verbose(false),
 			exact(Exact),
 			chmod_clear(Chmod_clear),
 			debug(Debug),
-			fis(sp),
+			threads(Threads),
+			compare_fds(lockstep_comparator::open_budget(Threads)),
+			use_uring(Use_uring),
+			inode_order(Inode_order),
+			physical_order(Physical_order),
+			reflink(Reflink),
+			sp(Huge_pages),
+			paths(nodes, sp),
+			fis(paths),
 			talker(Talker)
 	{
-		dummy.clear();
+		string why;
+		engine.reset(new_stat_engine(use_uring, why));
+		if (use_uring && !why.empty()) {
+			talker.warning("Not using io_uring: %s", why.c_str());
+			use_uring = false;
+		}
+
+		if (io.is_mapped())
+			mapped_io::install();
+
+		if (!Cache_path.empty()) {
+			unique_ptr<hash_engine> e(new_hash_engine(hash_name));
+
+			why.clear();
+			cache.reset(new hash_cache(Cache_path, hash_name,
+						e->digest_words(), prehash_size,
+						checksummer::leaf_size()));
+			cache->load(why);
+			if (!why.empty())
+				talker.warning("Ignoring hash cache '%s': %s",
+						Cache_path.c_str(),
+						why.c_str());
+			else
+				talker.info("Hash cache: %zu entries",
+						cache->size());
+		}
+	}
+
+	virtual ~collector() {
+	}
+
+	void collect(const char *p) {
+		if (threads > 1) {
+			collect_parallel(p);
+		} else {
+			struct stat st;
+			int rc = file_utils::stat_entry(AT_FDCWD, p, DT_UNKNOWN,
+					st);
+			collect(no_file, AT_FDCWD, p, rc < 0 ? errno : 0,
+					entry_stat(st));
+		}
+		string u = formatter::sprintf(
+			"Files: %zu, eligibles: %zu, hard links: %zu.",
+			file_count,
+			eligible_file_count,
+			hard_link_count);
+		pg.finish(u.c_str());
+	}
+
+	// Collects the entry basename of the directory open on at, fip
+	// being the node of that directory; st is the result of stat'ing
+	// the entry, unless err is set.
+	void collect(file_index fip, int at, const char *basename,
+			int err, const entry_stat &st) {
+		if (err) {
+			talker.warning(
+				"Warning: Cannot stat '%s': %s\n",
+				entry_path(fip, basename).c_str(),
+				strerror(err));
+			pg.occupied();
+		} else {
+			file_count ++;
+
+			file_index nfi = enter(fip, basename, st.dev,
+					st.ino, st.mode, st.size);
+
+			if (nfi != no_file) {
+				try {
+					collect_dir(nfi, at, basename);
+				}
+				catch(exception &e) {
+					talker.warning("While "
+						"collecting %s: %s",
+						path_of(nfi).c_str(),
+						e.what());
+				}
+			}
+		}
+	}
+
+	// Registers a stat'ed entry.  Returns the new node when it is a
+	// directory that should be descended into, no_file otherwise.
+	file_index enter(file_index fip, const char *basename,
+			dev_t dev, ino_t ino, mode_t mode, off_t size)
+	{
+		bool is_dir = S_ISDIR(mode);
+		bool is_eligible_file = S_ISREG(mode) && size >= min_size;
+
+		if (!is_dir && !is_eligible_file) return no_file;
+
+		file_index nfi = nodes.add(sp.add(basename), fip, dev, ino,
+				mode);
+		bool has_known_links = key_collection.insert(nfi) != no_file;
+
+		if (has_known_links) {
+			hard_link_count ++;
+		} else if (is_dir) {
+			if (dir_filter.accept(basename))
+				return nfi;
+
+			ignored_dir_count ++;
+			if (verbose) {
+				talker.warning("Ignoring %s",
+						path_of(nfi).c_str());
+				pg.occupied();
+			}
+		} else if (is_eligible_file) {
+			fis.set(nfi);
+			size_entry se;
+			se.size = size;
+			se.fi = nfi;
+			se.dev = nodes.dev(nfi);
+			id_collection.push_back(se);
+			pg.tick(1);
+			eligible_file_count ++;
+			eligible_byte_count += size;
+		}
+
+		return no_file;
+	}
+
+	void collect_parallel(const char *p) {
+		struct stat st;
+
+		if (lstat(p, &st) < 0) {
+			talker.warning(
+				"Warning: Cannot stat '%s': %s\n",
+				p, strerror(errno));
+			pg.occupied();
+			return;
+		}
+
+		file_count ++;
+
+		file_index nfi = enter(no_file, p, st.st_dev, st.st_ino,
+				st.st_mode, st.st_size);
+		if (nfi == no_file) return;
+
+		parallel_walker walker(threads, use_uring, inode_order,
+				min_size, dir_filter, talker, pg);
+		file_key fk(st.st_dev, st.st_ino);
+		walker.walk(p, walker.claim(fk));
+
+		pg.reset();
+		replay(walker, nfi, walker.take(fk));
+	}
+
+	// Registers the entries of a scanned directory in the order a
+	// serial walk would have met them, then frees its listing.  Each
+	// directory is entered once, so each listing is replayed once.
+	void replay(parallel_walker &walker, file_index fip,
+			unique_ptr<dir_listing> l)
+	{
+		file_count += l->other_count;
+
+		for (auto &e: l->entries) {
+			file_count ++;
+
+			file_index nfi = enter(fip, l->sp.get(e.name), e.dev,
+					e.ino, e.mode, e.size);
+			if (nfi == no_file) continue;
+
+			unique_ptr<dir_listing> sub =
+				walker.take(file_key(e.dev, e.ino));
+			if (sub) replay(walker, nfi, move(sub));
+		}
+	}
+
+	void collect_dir(file_index fip, int at, const char *name) {
+		unix_dir d(at, name);
+		dir_batch b;
+
+		while (read_batch(d, b, inode_order)) {
+			engine->stat_all(d.fd(), b);
+			for (auto &e: b.entries)
+				collect(fip, d.fd(), b.name(e), e.err, e.st);
+		}
+	}
+
+	// Full paths are only built when something must be reported.
+	string entry_path(file_index fip, const char *basename) {
+		return paths.get(fip, basename);
+	}
+
+	string path_of(file_index fi) {
+		return paths.get(fi);
+	}
+
+	template<class F>
+	size_t generic_size(F &f) {
+		size_t n = 0;
+		for (auto __attribute__((unused)) &x: f) n ++;
+		return n;
+	}
+
+	template<class F>
+	void display_files(const char *msg, const file_id &fid,
+			F &fiv, path_builder &pb)
+	{
+		fmt::pf("%s %zu %zu", msg,
+				generic_size(fiv) * fid.size,
+				fid.size);
+		for (auto &fi: fiv) {
+			fmt::pf(" ");
+			fmt::print_quoted(stdout, pb.get(fi).c_str());
+		}
+
+		fmt::pf("\n");
+	}
+
+	template<class F>
+	void display_files(const char *msg, const file_id &fid,
+			F &fiv)
+	{
+		display_files(msg, fid, fiv, paths);
+	}
+
+	template<class F>
+	void display_files_debug(const char *msg, const file_id &fid,
+			F &fiv)
+	{
+		if (debug) display_files(msg, fid, fiv);
+	}
+
+	// With --reflink, groups are only candidates, which the kernel
+	// compares as it shares their blocks: share_blocks dumps and counts
+	// as saveable what it actually shared.
+	void register_duplicates(const file_id &fid, file_infos &fiv)
+	{
+		if (stream)
+			stream->push(fid, fiv);
+		else
+			dupes.push_back(pair<file_id, file_infos>(fid, fiv));
+
+		size_t m = fiv.size();
+		duplicate_count += m;
+		if (!reflink)
+			saveable_space += (m - 1) * fid.size;
+	}
+
+	void register_collisions(const digest &hash,
+			const file_id &fid, file_infos &fiv)
+	{
+		string u = formatter::sprintf("collisions 0x%s",
+				hash.hex().c_str());
+		display_files(u.c_str(), fid, fiv);
+	}
+
+	void equal_files(const file_id &fid, file_infos &fiv) {
+		register_duplicates(fid, fiv);
+	}
+
+	off_t get_saveable_space(void) {
+		return saveable_space;
+	}
+
+	off_t get_ignored_dir_count(void) {
+		return ignored_dir_count;
+	}
+
+	void show_memory_statistics() {
+		size_t files = nodes.memory(),
+		       names = sp.memory(),
+		       inodes = key_collection.memory(),
+		       sizes = id_collection.capacity() * sizeof(size_entry);
+		double n = max(eligible_file_count, off_t(1));
+
+		talker.info("Memory: file table %zu, names %zu, "
+				"inode index %zu, size index %zu bytes",
+				files, names, inodes, sizes);
+		talker.info("Memory per eligible file: file table %.1f, "
+				"names %.1f, indexes %.1f bytes",
+				files / n, names / n, (inodes + sizes) / n);
+	}
+
+	// What was found in a bundle, to be registered in bundle order.
+	struct check_result {
+		vector<file_infos> equal;
+		vector< pair<digest, file_infos> > collisions;
+		vector<string> warnings;
+	};
+
+	// Checks bundles of files of the same size and device.  Each thread
+	// of the check phase has its own, with its own path cache and
+	// buffers, so that they share nothing but the file table.
+	class bundle_checker : non_copyable {
+		collector &c;
+		path_builder paths;
+		tickable &tck;
+		block_arena blocks;
+		checksummer sum;
+		check_result *result;
+		unsigned file_threads;
+		map<file_index, hash_cache::entry> bundle_cache;
+
+	public:
+		stage_counter prehash_stage, checksum_stage, compare_stage;
+
+		// The cache records of the files checked, and the number of
+		// digests found in the cache.
+		vector<uint64_t> cached;
+		size_t cache_hits;
+
+		// The files known to be equal because they already share
+		// all their blocks, with --reflink.
+		size_t already_shared;
+
+		bundle_checker(collector &C, tickable &Tck) :
+			c(C),
+			paths(C.nodes, C.sp),
+			tck(Tck),
+			sum(new_hash_engine(C.hash_name), C.io),
+			result(0),
+			file_threads(1),
+			prehash_stage("pre-hash"),
+			checksum_stage("checksum"),
+			compare_stage("compare"),
+			cache_hits(0),
+			already_shared(0)
+		{
+		}
+
+		// Large files are hashed reading up to File_threads parts of
+		// them at once.
+		void check(const file_id &fid, file_infos &fis,
+				check_result &r, unsigned File_threads)
+		{
+			result = &r;
+			file_threads = File_threads;
+			if (c.reflink)
+				shared_bundle(fid, fis);
+			else
+				prehash_bundle(fid, fis);
+			result = 0;
+
+			// Entries without digests are kept too: they replace
+			// the records of files that changed.
+			for (auto &it: bundle_cache)
+				c.cache->pack(it.second, cached);
+			bundle_cache.clear();
+		}
+
+	private:
+		string path_of(file_index fi) {
+			return paths.get(fi);
+		}
+
+		void display_files_debug(const char *msg, const file_id &fid,
+				file_infos &fiv)
+		{
+			if (c.debug) c.display_files(msg, fid, fiv, paths);
+		}
+
+		// The cache entry of fi, as found in the cache or to be
+		// filled in.  Null without a cache, or if fi can't be
+		// stat'ed.
+		hash_cache::entry *cache_entry(file_index fi, const string &u)
+		{
+			if (!c.cache) return 0;
+
+			auto it = bundle_cache.find(fi);
+			if (it != bundle_cache.end()) return &it->second;
+
+			struct stat st;
+			if (stat(u.c_str(), &st) < 0) return 0;
+
+			hash_cache::entry &e = bundle_cache[fi];
+			hash_cache::key k = hash_cache::make_key(st);
+			if (!c.cache->find(k, e))
+				e.k = k;
+			return &e;
+		}
+
+		digest checksum(file_index fi, const string &u, off_t size)
+		{
+			hash_cache::entry *e = cache_entry(fi, u);
+
+			if (e && e->has_full) {
+				cache_hits ++;
+				return e->full;
+			}
+
+			digest d = sum.checksum(u.c_str(), size, file_threads);
+			if (e) {
+				e->full = d;
+				e->has_full = true;
+			}
+			return d;
+		}
+
+		digest sample(file_index fi, const string &u, off_t size)
+		{
+			hash_cache::entry *e = cache_entry(fi, u);
+
+			if (e && e->has_sample) {
+				cache_hits ++;
+				return e->sample;
+			}
+
+			digest d = sum.sample(u.c_str(), size, c.prehash_size);
+			tck.tick(min(size, 2 * c.prehash_size));
+			if (e) {
+				e->sample = d;
+				e->has_sample = true;
+			}
+			return d;
+		}
+
+		void warning(const char *what, const string &u,
+				const exception &e)
+		{
+			result->warnings.push_back(formatter::sprintf(
+					"Can't %s '%s': %s",
+					what, u.c_str(), e.what()));
+		}
+
+		bool verify_equality(const file_id &fid, file_infos &fis)
+		{
+			display_files_debug("verify", fid, fis);
+
+			if (!c.exact) return true;
+
+			file_cong cong = congruence(fis);
+			return cong.size() == 1 && cong[0].size() == fis.size();
+		}
+
+		typedef vector<file_infos> file_cong;
+
+		// The classes of identical files in a bundle, leaving out
+		// the files that match no other.
+		file_cong congruence(file_infos &fiv)
+		{
+			const unsigned m = fiv.size();
+
+			assert(fiv.size() > 1);
+
+			vector<string> names(m);
+
+			for(unsigned i = 0; i < m; i ++)
+				names[i] = path_of(fiv[i]);
+
+			lockstep_comparator lc(names, blocks, c.io,
+					c.compare_fds, &tck);
+
+			file_cong cong;
+			for (auto &g: lc.classes()) {
+				cong.resize(cong.size() + 1);
+				for (unsigned i: g)
+					cong.back().push_back(fiv[i]);
+			}
+
+			for (auto &u: lc.errors())
+				result->warnings.push_back(u);
+
+			return cong;
+		}
+
+		void equal_files(file_infos &fiv) {
+			result->equal.push_back(fiv);
+		}
+
+		void check_bundle(const digest &hash,
+				const file_id &fid, file_infos &fis,
+				int iterations)
+		{
+			size_t m = fis.size();
+
+			if (m == 1) return;
+			assert(m > 1);
+			display_files_debug("check_bundle", fid, fis);
+
+			// Two files are compared rather than hashed, unless
+			// their digests are cached, or the hash is trusted and
+			// hashing them can use several threads or be cached.
+			bool hash_pair = c.trust_hash && (c.cache ||
+					(file_threads > 1 &&
+					 checksummer::is_tree(fid.size)));
+
+			if (m == 2 && !hash_pair && c.cache) {
+				hash_pair = true;
+				for (auto &fi: fis) {
+					hash_cache::entry *e =
+						cache_entry(fi, path_of(fi));
+					if (!e || !e->has_full)
+						hash_pair = false;
+				}
+			}
+
+			if (iterations == 0 ||
+					(c.exact && m == 2 && !hash_pair)) {
+				if (c.reflink) {
+					equal_files(fis);
+					return;
+				}
+				compare_stage.in(m, fid.size);
+				if (verify_equality(fid, fis)) {
+					equal_files(fis);
+				} else {
+					compare_stage.eliminated(m, fid.size);
+					if (m > 2)
+						result->collisions.push_back(
+							make_pair(hash, fis));
+				}
+				return;
+			}
+
+			map<digest, file_infos> resolve;
+			bool hashed = m > 2 || hash_pair;
+
+			if (!hashed) {
+				for (auto& fi: fis)
+					resolve[digest()].push_back(fi);
+			} else for (auto& fi: fis) {
+				string u = path_of(fi);
+				checksum_stage.in(1, fid.size);
+				try {
+					digest d = checksum(fi, u, fid.size);
+					if (c.debug)
+						fmt::pf("csum 0x%s '%s'\n",
+							d.hex().c_str(),
+							u.c_str());
+					resolve[d].push_back(fi);
+				} catch(exception &e) {
+					warning("checksum", u, e);
+				}
+			}
+
+			for (auto &it: resolve) {
+				if (it.second.size() <= 1) {
+					checksum_stage.eliminated(
+							it.second.size(),
+							fid.size);
+					continue;
+				}
+				if (hashed && c.trust_hash)
+					equal_files(it.second);
+				else
+					compare_bundle(fid, it.second);
+			}
+		}
+
+		// With --reflink, FIDEDUPERANGE compares the files as it
+		// shares their blocks, so they are not compared here; the
+		// group is a candidate that is only dumped and counted once
+		// the kernel has shared it.
+		void compare_bundle(const file_id &fid, file_infos &fis)
+		{
+			if (c.reflink) {
+				equal_files(fis);
+				return;
+			}
+			compare_stage.in(fis.size(), fid.size);
+			file_cong cong = congruence(fis);
+
+			size_t kept = 0;
+			for (auto &it: cong) {
+				equal_files(it);
+				kept += it.size();
+			}
+			compare_stage.eliminated(fis.size() - kept, fid.size);
+		}
+
+		// Checks a bundle with --reflink.  Files that already share
+		// all their blocks with one another, having been deduplicated
+		// before, are known to be equal without reading them: only
+		// the first file of each such class is checked, and the
+		// others join whatever it is found equal to.
+		void shared_bundle(const file_id &fid, file_infos &fis)
+		{
+			map< vector<uint64_t>, file_infos > classes;
+			map<file_index, file_infos *> class_of;
+			file_infos leaders;
+			vector<uint64_t> extents;
+
+			for (auto &fi: fis) {
+				string u = path_of(fi);
+				int fd = open(u.c_str(), O_RDONLY | O_NOFOLLOW);
+				bool shared = fd >= 0 &&
+					file_utils::shared_extents(fd, extents);
+
+				if (fd >= 0) close(fd);
+				if (!shared) {
+					leaders.push_back(fi);
+					continue;
+				}
+
+				file_infos &g = classes[extents];
+				if (g.empty()) {
+					leaders.push_back(fi);
+					class_of[fi] = &g;
+				} else {
+					already_shared ++;
+				}
+				g.push_back(fi);
+			}
+
+			if (leaders.size() == fis.size()) {
+				prehash_bundle(fid, fis);
+				return;
+			}
+
+			size_t first = result->equal.size();
+			if (leaders.size() > 1)
+				prehash_bundle(fid, leaders);
+
+			for (size_t k = first; k < result->equal.size(); k ++) {
+				file_infos joined;
+
+				for (auto &fi: result->equal[k]) {
+					auto it = class_of.find(fi);
+					if (it == class_of.end()) {
+						joined.push_back(fi);
+						continue;
+					}
+					joined.insert(joined.end(),
+							it->second->begin(),
+							it->second->end());
+					it->second->clear();
+				}
+				result->equal[k].swap(joined);
+			}
+
+			for (auto &it: classes) {
+				if (it.second.size() > 1)
+					equal_files(it.second);
+			}
+		}
+
+		// Splits a bundle on the hash of the first and last
+		// prehash_size bytes of its files before handing the parts to
+		// check_bundle.
+		void prehash_bundle(const file_id &fid, file_infos &fis)
+		{
+			const off_t n = c.prehash_size;
+
+			if (n <= 0) {
+				check_bundle(digest(), fid, fis,
+						c.hash_iterations);
+				return;
+			}
+
+			display_files_debug("prehash_bundle", fid, fis);
+
+			map<digest, file_infos> resolve;
+
+			for (auto& fi: fis) {
+				string u = path_of(fi);
+				prehash_stage.in(1, fid.size);
+				try {
+					digest d = sample(fi, u, fid.size);
+					resolve[d].push_back(fi);
+				} catch(exception &e) {
+					warning("pre-hash", u, e);
+				}
+			}
+
+			// When the samples cover the whole files, they are as
+			// good as a full checksum.
+			bool whole = fid.size <= 2 * n;
+
+			for (auto &it: resolve) {
+				if (it.second.size() <= 1) {
+					prehash_stage.eliminated(
+							it.second.size(),
+							fid.size);
+					continue;
+				}
+				if (whole && c.trust_hash)
+					equal_files(it.second);
+				else if (whole)
+					compare_bundle(fid, it.second);
+				else
+					check_bundle(it.first, fid, it.second,
+							c.hash_iterations);
+			}
+		}
+	};
+
+	// A bundle handed to the threads of the check phase.
+	struct check_job {
+		file_id fid;
+		uint16_t dev;
+		file_infos bundle;
+		check_result result;
+		bool started, done;
+
+		check_job() : dev(0), started(false), done(false) { }
+	};
+
+	// Gets the run of files of the same size and device starting at
+	// index i of id_collection or after, and moves i past it.  Returns
+	// false when there is none left.
+	bool next_bundle(size_t &i, uint16_t &dev, file_id &fid,
+			file_infos &bundle)
+	{
+		const size_t n = id_collection.size();
+
+		for (size_t j; i < n; i = j) {
+			const size_entry &se = id_collection[i];
+
+			for (j = i + 1; j < n &&
+					id_collection[j].size == se.size &&
+					id_collection[j].dev == se.dev; j ++);
+			if (j - i == 1) continue;
+
+			// Most recently collected first, unless ordered by
+			// location
+			dev = se.dev;
+			fid.dev = nodes.device(se.dev);
+			fid.size = se.size;
+			bundle.clear();
+			for (size_t k = j; k > i; k --)
+				bundle.push_back(id_collection[k - 1].fi);
+			if (physical_order)
+				reverse(bundle.begin(), bundle.end());
+
+			i = j;
+			return true;
+		}
+		return false;
 	}
 
-	virtual ~collector() {
+	void register_result(const file_id &fid, check_result &r)
+	{
+		for (auto &u: r.warnings) {
+			talker.warning("%s", u.c_str());
+			pg.occupied();
+		}
+		for (auto &it: r.equal)
+			equal_files(fid, it);
+		for (auto &it: r.collisions)
+			register_collisions(it.first, fid, it.second);
+		r = check_result();
 	}
 
-	void collect(const char *p) {
-		current.set(p);
-		collect(&dummy, p);
-		string u = formatter::sprintf(
-			"Files: %zu, eligibles: %zu, hard links: %zu.",
-			file_count,
-			eligible_file_count,
-			hard_link_count);
-		pg.finish(u.c_str());
-	}
+	// How many bundles of each device may be read at once.  Parallel
+	// sequential reads make spinning disks seek back and forth, while
+	// SSDs need several requests in flight to be busy.
+	vector<unsigned> device_read_limits()
+	{
+		vector<unsigned> limits(nodes.device_count(), threads);
 
-	void collect(const file_info *fip, const char *basename) {
-		struct stat st;
+		for (unsigned d = 0; d < limits.size(); d ++) {
+			if (device_reads > 0)
+				limits[d] = device_reads;
+			else if (file_utils::rotational(nodes.device(d)))
+				limits[d] = 1;
+		}
+		return limits;
+	}
 
-		int rc = lstat(current.get().c_str(), &st);
-		if (rc < 0) {
-			talker.warning(
-				"Warning: Cannot stat '%s': %s\n",
-				current.get().c_str(),
-				strerror(errno));
-			pg.occupied();
-		} else {
-			file_count ++;
+	void check_serial(vector< unique_ptr<bundle_checker> > &checkers)
+	{
+		checkers.push_back(unique_ptr<bundle_checker>(
+					new bundle_checker(*this, pg)));
+		bundle_checker &bc = *checkers.back();
+		size_t i = 0;
+		uint16_t dev;
+		file_id fid;
+		file_infos bundle;
+		check_result r;
+
+		while (next_bundle(i, dev, fid, bundle)) {
+			fis.set(bundle.front());
+			bc.check(fid, bundle, r, 1);
+			register_result(fid, r);
+		}
+	}
 
-			bool is_dir = S_ISDIR(st.st_mode);
-			bool is_eligible_file =
-				S_ISREG(st.st_mode) && st.st_size >= min_size;
+	// Bundles are checked by a pool of threads, but registered by the
+	// main thread in the same order as check_serial would.
+	void check_parallel(vector< unique_ptr<bundle_checker> > &checkers)
+	{
+		const size_t window = 4 * threads;
+		const vector<unsigned> limits = device_read_limits();
+		vector<unsigned> reading(limits.size(), 0);
+		deque<check_job> jobs;
+		bool finished = false;
+		mutex m;
+		condition_variable cv;
+		tick_counter ticks;
+		vector<thread> workers;
+
+		for (unsigned k = 0; k < threads; k ++)
+			checkers.push_back(unique_ptr<bundle_checker>(
+					new bundle_checker(*this, ticks)));
+
+		auto work = [&](bundle_checker *bc) {
+			unique_lock<mutex> lock(m);
+
+			for (;;) {
+				check_job *job = 0;
+				bool pending = false;
+
+				for (auto &j: jobs) {
+					if (j.started) continue;
+					pending = true;
+					if (reading[j.dev] < limits[j.dev]) {
+						job = &j;
+						break;
+					}
+				}
+				if (!job) {
+					if (finished && !pending) break;
+					cv.wait(lock);
+					continue;
+				}
 
-			if (!is_dir && !is_eligible_file) return;
+				// The threads reading the leaves of large
+				// files count against the budget of the
+				// device, out of what other bundles leave.
+				const unsigned d = job->dev;
+				unsigned readers = 1;
+				if (checksummer::is_tree(job->fid.size))
+					readers = min(threads,
+						limits[d] - reading[d]);
+
+				job->started = true;
+				reading[d] += readers;
+				lock.unlock();
+				bc->check(job->fid, job->bundle, job->result,
+						readers);
+				lock.lock();
+				reading[d] -= readers;
+				job->done = true;
+				cv.notify_all();
+			}
+		};
+
+		// If a worker can't be started, those already running are
+		// stopped and joined, and the bundles checked serially.
+		try {
+			for (auto &bc: checkers)
+				workers.push_back(thread(work, bc.get()));
+		} catch(exception &e) {
+			{
+				lock_guard<mutex> lock(m);
+				finished = true;
+			}
+			cv.notify_all();
+			for (auto &t: workers)
+				t.join();
 
-			file_key fk(st.st_dev, st.st_ino);
-			file_info fi;
-			file_id fid;
+			talker.warning("Warning: can't start %u threads, "
+					"checking serially: %s",
+					threads, e.what());
+			pg.occupied();
+			checkers.clear();
+			check_serial(checkers);
+			return;
+		}
 
-			fi.name = sp.add(basename);
-			fi.mode = st.st_mode;
-			fi.ino = st.st_ino;
-			fi.parent = fip;
+		size_t i = 0;
+		unique_lock<mutex> lock(m);
 
-			fid.dev = st.st_dev;
-			fid.size = st.st_size;
+		while (!finished || !jobs.empty()) {
+			bool added = false;
 
-			forward_list<file_info> &kv = key_collection[fk];
-			bool has_known_links = !kv.empty();
-			kv.push_front(fi);
-			file_info &nfi = kv.front();
+			while (!finished && jobs.size() < window) {
+				check_job j;
 
-			if (has_known_links) {
-				hard_link_count ++;
-			} else if (is_dir) {
-				if (dir_filter.accept(basename)) {
-					try {
-						collect_dir(&nfi);
-					}
-					catch(exception &e) {
-						talker.warning("While "
-							"collecting %s: %s",
-							current.get().c_str(),
-							e.what());
-					}
+				if (next_bundle(i, j.dev, j.fid, j.bundle)) {
+					jobs.push_back(move(j));
 				} else {
-					ignored_dir_count ++;
-					if (verbose) {
-						talker.warning(
-							"Ignoring %s",
-							current.get().c_str());
-						pg.occupied();
-					}
+					finished = true;
 				}
-			} else if (is_eligible_file) {
-				fis.set(&nfi);
-				id_collection[fid].push_front(&nfi);
-				pg.tick(1);
-				eligible_file_count ++;
-				eligible_byte_count += fid.size;
+				added = true;
+			}
+			if (added)
+				cv.notify_all();
+
+			if (!jobs.empty() && jobs.front().done) {
+				check_job j = move(jobs.front());
+				jobs.pop_front();
+				lock.unlock();
+				fis.set(j.bundle.front());
+				register_result(j.fid, j.result);
+				lock.lock();
+				continue;
 			}
+
+			cv.wait_for(lock, chrono::milliseconds(50));
+			lock.unlock();
+			pg.tick(ticks.take());
+			lock.lock();
 		}
+		lock.unlock();
+
+		for (auto &t: workers)
+			t.join();
 	}
 
-	void collect_dir(const file_info *fip) {
-		const struct dirent *e;
-		string u;
+	// Reorders the bundles of id_collection so that those of each
+	// device are checked in the order of the location of their first
+	// file on disk, and the files of each bundle in the order of
+	// theirs.  The heads of spinning disks then sweep across the
+	// platters instead of seeking back and forth between files of
+	// neighbouring sizes.  Locations are the physical offsets of the
+	// first extents of the files, or their inode numbers where the
+	// filesystem does not support FIEMAP.
+	void order_physically(const vector<uint16_t> &rank)
+	{
+		struct location {
+			uint64_t key;
+			size_t i;
 
-		unix_dir d(current.get().c_str());
+			bool operator<(const location &b) const {
+				return key < b.key;
+			}
+		};
+
+		const size_t n = id_collection.size();
+		vector<location> loc;
+		vector<size_t> runs;
+		vector<uint64_t> physical, ino;
+		vector<bool> fiemap(nodes.device_count(), true);
+
+		for (size_t i = 0, j; i < n; i = j) {
+			const size_entry &se = id_collection[i];
+
+			for (j = i + 1; j < n &&
+					id_collection[j].size == se.size &&
+					id_collection[j].dev == se.dev; j ++);
+			if (j - i == 1) continue;
+
+			runs.push_back(loc.size());
+			for (size_t k = i; k < j; k ++) {
+				string u = paths.get(id_collection[k].fi);
+				int fd = open(u.c_str(), O_RDONLY | O_NOFOLLOW);
+				struct stat st;
+				uint64_t p = 0;
+
+				ino.push_back(numeric_limits<uint64_t>::max());
+				if (fd >= 0 && fstat(fd, &st) == 0) {
+					ino.back() = st.st_ino;
+					if (!file_utils::first_extent(fd, p))
+						fiemap[se.dev] = false;
+				}
+				if (fd >= 0) close(fd);
+				physical.push_back(p);
+				loc.push_back(location { 0, k });
+			}
+		}
+		runs.push_back(loc.size());
 
-		while (d.read(e)) {
-			if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
-				continue;
+		const uint64_t unknown = numeric_limits<uint64_t>::max();
+		size_t by_extent = 0, by_inode = 0;
+		for (size_t k = 0; k < loc.size(); k ++) {
+			uint16_t d = id_collection[loc[k].i].dev;
 
-			current.push(e->d_name);
-			collect(fip, e->d_name);
-			current.pop();
+			if (ino[k] == unknown || !fiemap[d]) {
+				loc[k].key = ino[k];
+				by_inode += ino[k] != unknown;
+			} else {
+				loc[k].key = physical[k];
+				by_extent ++;
+			}
 		}
-	}
 
-	template<class F>
-	size_t generic_size(F &f) {
-		size_t n = 0;
-		for (auto __attribute__((unused)) &x: f) n ++;
-		return n;
+		// The read distance of the first extents, in the order of the
+		// bundles and their files given, on the devices with FIEMAP.
+		auto distance = [&](const vector<location> &v) {
+			uint64_t total = 0;
+			for (size_t k = 1; k < v.size(); k ++) {
+				uint16_t d = id_collection[v[k].i].dev;
+				uint64_t a = v[k - 1].key, b = v[k].key;
+
+				if (fiemap[d] && a != unknown && b != unknown &&
+					d == id_collection[v[k - 1].i].dev)
+					total += a > b ? a - b : b - a;
+			}
+			return total;
+		};
+
+		vector<location> before;
+		for (size_t r = 0; r + 1 < runs.size(); r ++)
+			for (size_t k = runs[r + 1]; k > runs[r]; k --)
+				before.push_back(loc[k - 1]);
+
+		// Order each bundle, then the bundles by device and by their
+		// first file.
+		vector<size_t> order;
+		for (size_t r = 0; r + 1 < runs.size(); r ++) {
+			sort(loc.begin() + runs[r], loc.begin() + runs[r + 1]);
+			order.push_back(r);
+		}
+		sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			uint16_t da = id_collection[loc[runs[a]].i].dev;
+			uint16_t db = id_collection[loc[runs[b]].i].dev;
+			return rank[da] < rank[db] || (rank[da] == rank[db] &&
+				loc[runs[a]] < loc[runs[b]]);
+		});
+
+		vector<location> after;
+		vector<size_entry> ordered;
+		for (size_t r: order) {
+			for (size_t k = runs[r]; k < runs[r + 1]; k ++) {
+				after.push_back(loc[k]);
+				ordered.push_back(id_collection[loc[k].i]);
+			}
+		}
+		id_collection.swap(ordered);
+
+		talker.info("Read order: %zu files by physical location, "
+				"%zu by inode", by_extent, by_inode);
+		if (by_extent > 0)
+			talker.info("Seek distance: %" PRIu64 " MiB, "
+					"down from %" PRIu64 " MiB",
+					distance(after) >> 20,
+					distance(before) >> 20);
 	}
 
-	template<class F>
-	void display_files(const char *msg, const file_id &fid,
-			F &fiv)
-	{
-		fmt::pf("%s %zu %zu", msg,
-				generic_size(fiv) * fid.size,
-				fid.size);
-		for (auto &fi: fiv) {
-			fmt::pf(" ");
-			fmt::print_quoted(stdout, fi->get_path(sp).c_str());
+	void check() {
+		pg.reset(eligible_byte_count, 20);
+		pg.occupied();
+
+		// Devices are numbered in the order they were met; group
+		// them in the order of their IDs.
+		vector<uint16_t> order(nodes.device_count()),
+			rank(nodes.device_count());
+		for (unsigned d = 0; d < order.size(); d ++) order[d] = d;
+		sort(order.begin(), order.end(),
+				[this](uint16_t a, uint16_t b) {
+					return nodes.device(a) <
+						nodes.device(b); });
+		for (unsigned r = 0; r < order.size(); r ++) rank[order[r]] = r;
+
+		radix_sort(id_collection, [&rank](const size_entry &se) {
+				return uint64_t(rank[se.dev]); });
+		radix_sort(id_collection, [](const size_entry &se) {
+				return uint64_t(se.size); });
+		if (physical_order)
+			order_physically(rank);
+
+		vector< unique_ptr<bundle_checker> > checkers;
+
+		if (threads > 1)
+			check_parallel(checkers);
+		else
+			check_serial(checkers);
+
+		fis.set(no_file);
+		vector<size_entry>().swap(id_collection);
+
+		string u = formatter::sprintf(reflink ?
+				"Candidates for sharing: %zu files." :
+				"Duplicate file count: %zu.", duplicate_count);
+		pg.finish(u.c_str());
+
+		stage_counter prehash_stage("pre-hash"),
+			      checksum_stage("checksum"),
+			      compare_stage("compare");
+		vector<uint64_t> cached;
+		size_t cache_hits = 0, already_shared = 0;
+
+		for (auto &bc: checkers) {
+			prehash_stage.add(bc->prehash_stage);
+			checksum_stage.add(bc->checksum_stage);
+			compare_stage.add(bc->compare_stage);
+			cached.insert(cached.end(), bc->cached.begin(),
+					bc->cached.end());
+			vector<uint64_t>().swap(bc->cached);
+			cache_hits += bc->cache_hits;
+			already_shared += bc->already_shared;
 		}
 
-		fmt::pf("\n");
+		if (prehash_size > 0)
+			prehash_stage.show(talker);
+		checksum_stage.show(talker);
+		if (exact && !reflink)
+			compare_stage.show(talker);
+		if (reflink)
+			talker.info("Already sharing blocks: %zu files",
+					already_shared);
+		talker.info("I/O: %" PRIu64 " bytes read, %" PRIu64 " bytes "
+				"advised to drop from the page cache",
+				io.bytes_read(), io.bytes_dropped());
+
+		if (cache) {
+			talker.info("Hash cache: %zu digests reused",
+					cache_hits);
+			save_cache(cached);
+		}
 	}
 
-	template<class F>
-	void display_files_debug(const char *msg, const file_id &fid,
-			F &fiv)
-	{
-		if (debug) display_files(msg, fid, fiv);
+	void save_cache(vector<uint64_t> &cached) {
+		try {
+			cache->save(cached);
+		} catch(exception &e) {
+			talker.warning("Can't save hash cache: %s", e.what());
+		}
 	}
 
-	void register_duplicates(const file_id &fid,
-			vector<file_info*> &fiv)
-	{
-		dupes.push_back(pair<file_id, vector<file_info *> >(fid, fiv));
+	// How the copies of a group are deduplicated.
+	enum link_mode { no_links, hard_links, reflinks };
+
+	// What links groups of duplicates, with its own path cache and
+	// progress sink so that it can run in a thread of its own.
+	struct linker : non_copyable {
+		link_mode mode;
+		bool dump;
+		path_builder paths;
+		tickable &pg;
+		size_t shared, already_shared, differing, failed;
+		off_t bytes;
+
+		// The devices found not to support FIDEDUPERANGE, and the
+		// errors already reported for failing to share blocks.
+		vector<bool> unsupported;
+		set<int> reported;
+
+		// Buffers to compare the groups that can't be shared with
+		block_arena blocks;
+
+		// Where hard links are planned before they are made, if
+		// anywhere.
+		link_journal *journal;
+
+		linker(collector &c, link_mode Mode, bool Dump, tickable &Pg) :
+			mode(Mode),
+			dump(Dump),
+			paths(c.nodes, c.sp),
+			pg(Pg),
+			shared(0), already_shared(0), differing(0), failed(0),
+			bytes(0),
+			unsupported(c.nodes.device_count(), false),
+			journal(Mode == hard_links ? c.journal.get() : 0)
+		{ }
+	};
 
-		size_t m = fiv.size();
-		duplicate_count += m;
-		saveable_space += (m - 1) * fid.size;
-	}
+	// The names of the files of a group, the source first, then every
+	// name of each of the other files.
+	vector<string> link_names(linker &l, file_infos &fiv) {
+		vector<string> names(1, l.paths.get(fiv[0]));
 
-	void register_collisions(uint64_t hash,
-			const file_id &fid, file_infos &fiv)
-	{
-		string u = formatter::sprintf("collisions 0x%016" PRIx64,
-				hash);
-		display_files(u.c_str(), fid, fiv);
+		for (unsigned i = 1; i < fiv.size(); i ++) {
+			for (auto fi: key_collection.names(fiv[i]))
+				names.push_back(l.paths.get(fi));
+		}
+		return names;
 	}
 
-	bool verify_equality(const file_id &fid, file_infos &fis)
-	{
-		display_files_debug("verify", fid, fis);
+	void hard_link(linker &l, const file_id &fid, file_infos &fiv) {
+		if (debug) display_files("hard_link", fid, fiv, l.paths);
 
-		if (!exact) return true;
+		vector<string> names = link_names(l, fiv);
 
-		bool first = true;
-		string p_0, p_i;
+		if (l.journal) {
+			link_journal::group g = l.journal->plan(names);
+			l.journal->sync();
+			l.journal->finish(g, chmod_clear, false, l.pg, talker);
+			return;
+		}
 
-		for (auto &fi: fis) {
-			if (first) {
-				p_0 = fi->get_path(sp);
-				first = false;
-			} else {
-				p_i = fi->get_path(sp);
+		string source = names[0];
+		names.erase(names.begin());
+		file_utils::hard_link(source, names, l.pg, talker);
 
-				if (file_utils::compare(p_0.c_str(),
-							p_i.c_str()))
-					return false;
+		if (chmod_clear) {
+			int rc = chmod(source.c_str(),
+					nodes.mode(fiv[0]) & ~chmod_clear);
+			if (rc < 0) {
+				talker.warning(
+					"Warning: can't chmod "
+					"'%s': %s",
+					source.c_str(),
+					strerror(errno));
+				l.pg.occupied();
 			}
 		}
-
-		return true;
 	}
 
-	typedef vector<vector<file_info *> > file_cong;
-
-	file_cong congruence(const file_id &fid, vector<file_info *> &fiv)
+	// Opens a copy to share the blocks of.  Before Linux 4.19,
+	// FIDEDUPERANGE needs a destination open for writing unless the
+	// caller owns it, so it is only opened read-only if it can't be
+	// opened for writing.
+	static int open_target(const char *t)
 	{
-		const unsigned m = fiv.size();
+		int fd = open(t, O_RDWR | O_NOFOLLOW);
 
-		assert(fiv.size() > 1);
+		if (fd < 0 && (errno == EACCES || errno == EROFS ||
+					errno == ETXTBSY))
+			fd = open(t, O_RDONLY | O_NOFOLLOW);
+		return fd;
+	}
 
-		vector<string> names(m);
-		vector<unsigned> sigma(m);
+	// Makes the copies of a group share the blocks of its first file,
+	// leaving each file its own inode and metadata.  Copies that
+	// already share all their blocks with it are left alone, so that
+	// running again costs little.  Devices found not to support
+	// FIDEDUPERANGE are skipped.  The files the kernel found equal are
+	// dumped with --dump, and the bytes it shared counted as saveable.
+	void share_blocks(linker &l, const file_id &fid, file_infos &fiv)
+	{
+		if (debug) display_files("reflink", fid, fiv, l.paths);
 
-		for(unsigned i = 0; i < m; i ++) {
-			names[i] = fiv[i]->get_path(sp);
-			sigma[i] = i;
+		uint16_t d = nodes.dev(fiv[0]);
+		if (l.unsupported[d]) {
+			l.failed += fiv.size() - 1;
+			if (l.dump) dump_unshared(l, fid, fiv);
+			return;
 		}
 
-		file_comparator fc(names, &pg);
+		string source = l.paths.get(fiv[0]);
+		int sfd = open(source.c_str(), O_RDONLY | O_NOFOLLOW);
+		if (sfd < 0) {
+			talker.warning("Warning: can't open '%s': %s",
+					source.c_str(), strerror(errno));
+			l.pg.occupied();
+			l.failed += fiv.size() - 1;
+			return;
+		}
 
-		file_cong cong;
+		vector<uint64_t> mine, theirs;
+		bool shared = file_utils::shared_extents(sfd, mine);
+		vector<string> targets;
+		file_infos equal(1, fiv[0]), candidates;
+		vector<int> fds, status;
+		vector<off_t> bytes;
 
-		unsigned j;
-		for (j = 1; j < m && fc(j, j - 1) == 0; j ++);
-		if (j == m) {
-			cong.resize(1);
-			cong[0] = fiv;
-			return cong;
+		for (unsigned i = 1; i < fiv.size(); i ++) {
+			string t = l.paths.get(fiv[i]);
+			int fd = open_target(t.c_str());
+
+			l.pg.tick(1);
+			if (fd < 0) {
+				talker.warning("Warning: can't open '%s': %s",
+						t.c_str(), strerror(errno));
+				l.pg.occupied();
+				l.failed ++;
+			} else if (shared && file_utils::shared_extents(
+						fd, theirs) && theirs == mine) {
+				close(fd);
+				l.already_shared ++;
+				equal.push_back(fiv[i]);
+			} else {
+				targets.push_back(t);
+				candidates.push_back(fiv[i]);
+				fds.push_back(fd);
+			}
 		}
 
-		file_comparator::proxy fcp(fc);
-		sort(sigma.begin(), sigma.end(), fcp);
+		file_utils::dedupe(sfd, fid.size, fds, status, bytes);
+		close(sfd);
 
-		unsigned c = 0;
+		for (unsigned i = 0; i < fds.size(); i ++) {
+			close(fds[i]);
 
-		cong.resize(1);
-		cong[c].push_back(fiv[sigma[0]]);
+			const char *t = targets[i].c_str();
+			int s = status[i];
 
-		for(unsigned i = 1; i < m; i ++) {
-			if (fc(sigma[i], sigma[i - 1])) {
-				c ++;
-				cong.resize(c + 1);
+			l.bytes += bytes[i];
+			saveable_space += bytes[i];
+			if (s == file_utils::dedupe_shared) {
+				l.shared ++;
+				equal.push_back(candidates[i]);
+				continue;
+			}
+
+			if (s == file_utils::dedupe_differs) {
+				l.differing ++;
+				talker.warning("Warning: '%s' differs from "
+						"'%s', not sharing its blocks",
+						t, source.c_str());
+			} else if (s == -EOPNOTSUPP || s == -ENOTTY) {
+				l.failed ++;
+				if (!l.unsupported[d])
+					talker.warning("Warning: can't share "
+						"blocks on the file system of "
+						"'%s': %s",
+						t, strerror(-s));
+				l.unsupported[d] = true;
+			} else {
+				l.failed ++;
+				if (!l.reported.insert(s).second)
+					continue;
+				talker.warning("Warning: can't share the "
+						"blocks of '%s' with '%s': %s "
+						"(not reported again)",
+						source.c_str(), t,
+						strerror(-s));
 			}
-			cong[c].push_back(fiv[sigma[i]]);
+			l.pg.occupied();
 		}
 
-		return cong;
+		if (!l.dump) return;
+		if (l.unsupported[d]) {
+			dump_unshared(l, fid, fiv);
+		} else if (equal.size() > 1) {
+			display_files("duplicates", fid, equal, l.paths);
+			fflush(stdout);
+		}
 	}
 
-	void equal_files(const file_id &fid, vector<file_info *> &fiv) {
-		register_duplicates(fid, fiv);
-	}
+	// Dumps the classes of identical files of a group on a file system
+	// that can't share blocks, comparing them as the check phase does
+	// without --reflink.
+	void dump_unshared(linker &l, const file_id &fid, file_infos &fiv)
+	{
+		vector<string> names;
 
-	void equal_files(const file_id &fid, const file_infos &fis) {
-		vector<file_info *> fiv = file_infos_vectorize(fis);
-		equal_files(fid, fiv);
-	}
+		for (auto fi: fiv)
+			names.push_back(l.paths.get(fi));
+
+		lockstep_comparator lc(names, l.blocks, io, compare_fds);
+		for (auto &g: lc.classes()) {
+			file_infos equal;
+			for (unsigned i: g)
+				equal.push_back(fiv[i]);
+			display_files("duplicates", fid, equal, l.paths);
+		}
+		fflush(stdout);
 
-	vector<file_info *> file_infos_vectorize(const file_infos &fis) {
-		size_t m = generic_size(fis);
-		vector<file_info *> fiv(m);
-		unsigned i = 0;
-		for (auto& fi: fis) fiv[i ++] = fi;
-		return fiv;
+		for (auto &u: lc.errors()) {
+			talker.warning("%s", u.c_str());
+			l.pg.occupied();
+		}
 	}
 
-	off_t get_saveable_space(void) {
-		return saveable_space;
+	void link(linker &l, const file_id &fid, file_infos &fiv) {
+		if (l.mode == hard_links)
+			hard_link(l, fid, fiv);
+		else if (l.mode == reflinks)
+			share_blocks(l, fid, fiv);
 	}
 
-	off_t get_ignored_dir_count(void) {
-		return ignored_dir_count;
+	void show_link_statistics(const linker &l) {
+		if (l.mode != reflinks) return;
+
+		talker.info("Reflinked: %zu files, %zd bytes; already "
+				"shared: %zu, differing: %zu, failed: %zu",
+				l.shared, l.bytes, l.already_shared,
+				l.differing, l.failed);
 	}
 
-	void check_bundle(uint64_t hash,
-			const file_id &fid, file_infos &fis,
-			int iterations)
-	{
-		size_t m = generic_size(fis);
+	void link_duplicates(link_mode mode, bool dump) {
+		if (mode == hard_links)
+			fmt::fpf(stderr, "Hard-linking duplicates.\n");
+		else
+			fmt::fpf(stderr, "Sharing the blocks of duplicates.\n");
+		pg.occupied();
+		pg.reset();
+
+		linker l(*this, mode, dump, pg);
 
-		if (m == 1) return;
-		assert(m > 1);
-		display_files_debug("check_bundle", fid, fis);
+		// All groups are planned at once, so that --resume can link
+		// them all after a crash.
+		if (l.journal) {
+			vector<link_journal::group> groups;
 
-		if (iterations == 0 || (exact && m == 2)) {
-			if (verify_equality(fid, fis))
-				equal_files(fid, fis);
-			else if (m > 2)
-				register_collisions(hash, fid, fis);
+			for (auto &d: dupes)
+				groups.push_back(l.journal->plan(
+						link_names(l, d.second)));
+			l.journal->sync();
+			for (auto &g: groups)
+				l.journal->finish(g, chmod_clear, false, pg,
+						talker);
 			return;
 		}
 
-		map<uint64_t, vector<file_info*> > resolve;
-		checksummer c;
+		for (auto &d: dupes)
+			link(l, d.first, d.second);
+		show_link_statistics(l);
+	}
 
-		if (m <= 2) {
-			for (auto& fi: fis)
-				resolve[0].push_back(fi);
-		} else for (auto& fi: fis) {
-			string u = fi->get_path(sp);
-			try {
-				uint64_t sum = c.checksum(u.c_str());
-				if (debug)
-					fmt::pf("csum 0x%016" PRIx64 " '%s'\n",
-						sum, u.c_str());
-				resolve[sum].push_back(fi);
-			} catch(...) {
-				fmt::pf("csum (error) '%s'", u.c_str());
-			}
-		}
+	// Plans hard links in a journal at path before making them.
+	bool keep_journal(const string &path, string &why) {
+		journal.reset(new link_journal(path));
+		return journal->create(why);
+	}
 
-		for (auto &it: resolve) {
-			if (it.second.size() <= 1) continue;
-			file_cong cong = congruence(fid, it.second);
+private:
+	// With --stream, groups of duplicates are dumped as soon as they
+	// are registered, and handed to a thread that links them through a
+	// queue of at most depth groups, rather than kept in dupes until
+	// the check is over: their pages are then still in the page cache
+	// when they are linked, and memory does not grow with the number
+	// of duplicates.
+	class link_stream : non_copyable {
+		enum { depth = 64 };
+
+		collector &c;
+		bool dump;
+		tick_counter ticks;
+		linker l;
+		deque< pair<file_id, file_infos> > queue;
+		bool closed;
+		mutex m;
+		condition_variable cv;
+		thread worker;
+
+		// What stopped the linking, to be thrown again by finish.
+		exception_ptr error;
+
+		void run() {
+			unique_lock<mutex> lock(m);
+
+			while (!error) {
+				if (queue.empty()) {
+					if (closed) break;
+					cv.wait(lock);
+					continue;
+				}
 
-			for (auto &it2: cong) {
-				if (it2.size() > 1)
-					equal_files(fid, it2);
+				pair<file_id, file_infos> g =
+					move(queue.front());
+				queue.pop_front();
+				cv.notify_all();
+				lock.unlock();
+				try {
+					c.link(l, g.first, g.second);
+				} catch(...) {
+					lock.lock();
+					error = current_exception();
+					queue.clear();
+					cv.notify_all();
+					break;
+				}
+				lock.lock();
 			}
 		}
-	}
 
-	void check() {
-		pg.reset(eligible_byte_count, 20);
-		pg.occupied();
+		void join() {
+			if (!worker.joinable()) return;
 
-		for (auto &it: id_collection) {
-			fis.set(it.second.front());
-			check_bundle(0, it.first, it.second, hash_iterations);
+			{
+				unique_lock<mutex> lock(m);
+				closed = true;
+				cv.notify_all();
+			}
+			worker.join();
 		}
-		fis.set(NULL);
 
-		string u = formatter::sprintf(
-				"Duplicate file count: %zu.", duplicate_count);
-		pg.finish(u.c_str());
-	}
-
-	void hard_link(const file_id &fid, vector<file_info*> &fiv) {
-		display_files_debug("hard_link", fid, fiv);
+	public:
+		link_stream(collector &C, bool Dump, link_mode Mode) :
+			c(C),
+			dump(Dump),
+			l(C, Mode, Dump, ticks),
+			closed(false)
+		{
+			if (l.mode != no_links)
+				worker = thread(&link_stream::run, this);
+		}
 
-		string source = fiv[0]->get_path(sp);
-		vector<string> targets;
+		~link_stream() {
+			join();
+		}
 
-		for (unsigned i = 1; i < fiv.size(); i ++) {
-			file_key fk(fid.dev, fiv[i]->ino);
-			for (auto &fi: key_collection[fk])
-				targets.push_back(fi.get_path(sp));
+		// With --reflink, the linker dumps what it shares.
+		void push(const file_id &fid, file_infos &fiv) {
+			if (dump && l.mode != reflinks) {
+				c.display_files("duplicates", fid, fiv);
+				fflush(stdout);
+			}
+			if (l.mode == no_links) return;
+
+			unique_lock<mutex> lock(m);
+			while (queue.size() >= depth && !error)
+				cv.wait(lock);
+			if (error) return;
+			queue.push_back(make_pair(fid, fiv));
+			cv.notify_all();
 		}
 
-		file_utils::hard_link(source, targets, pg, talker);
+		// Waits for the groups queued to be linked.  Throws what
+		// stopped the linking, if anything did; the groups found after
+		// that are left alone.
+		void finish() {
+			if (!worker.joinable()) return;
 
-		if (chmod_clear) {
-			int rc = chmod(source.c_str(),
-					fiv[0]->mode & ~chmod_clear);
-			if (rc < 0) {
-				talker.warning(
-					"Warning: can't chmod "
-					"'%s': %s",
-					source.c_str(),
-					strerror(errno));
-				pg.occupied();
-			}
+			join();
+			if (error)
+				rethrow_exception(error);
+			c.show_link_statistics(l);
 		}
+	};
+
+public:
+	// Dumps and links groups as they are found, from now on.
+	void start_streaming(bool dump, link_mode mode) {
+		stream.reset(new link_stream(*this, dump, mode));
 	}
 
-	void hard_link_duplicates() {
-		fmt::fpf(stderr, "Hard-linking duplicates.\n");
-		pg.occupied();
-		pg.reset();
-		for (auto &d: dupes)
-			hard_link(d.first, d.second);
+	void finish_streaming() {
+		stream->finish();
 	}
 
 	void dump_duplicates() {
@@ -1410,6 +5872,23 @@ public:
 		return true;
 	}
 
+	// Pops one of the strings of the null-terminated array choices.
+	bool pop_choice(const char *dsc, const char *const *choices,
+			string &u) {
+		if (dry_run) {
+			fmt::fpf(stderr, " <%s>", dsc);
+			return true;
+		}
+		if (is_empty()) return false;
+		for (; *choices; choices ++) {
+			if (front() == *choices) {
+				u = front(); pop();
+				return true;
+			}
+		}
+		return false;
+	}
+
 	bool pop_keyword(const char *u) {
 		if (dry_run) {
 			fmt::fpf(stderr, " %s", u);
@@ -1474,7 +5953,15 @@ public:
 struct options : public talk_control {
 	string path;
 	int min_size;
+	int prehash_size;
+	string hash;
+	string cache;
+	string io;
+	bool drop_cache;
 	bool hard_link;
+	bool reflink;
+	bool stream;
+	string journal;
 	bool dump;
 	bool exact;
 	vector<string> ignored_dirs;
@@ -1484,42 +5971,181 @@ struct options : public talk_control {
 	bool progress;
 	bool show_info;
 	bool show_warnings;
+	int threads;
+	int device_reads;
+	bool uring;
+	bool inode_order;
+	bool physical_order;
+	bool huge_pages;
 
 	bool info_enabled() const { return show_info; }
 	bool warnings_enabled() const { return show_warnings; }
 
 	options() :
 		min_size(100000),
+		prehash_size(64),
+		hash("fast64"),
+		io("read"),
+		drop_cache(false),
 		hard_link(false),
+		reflink(false),
+		stream(false),
 		dump(false),
 		exact(true),
 		chmod_clear(0222),
 		debug(false),
 		progress(true),
 		show_info(true),
-		show_warnings(true)
+		show_warnings(true),
+		threads(1),
+		device_reads(0),
+		uring(false),
+		inode_order(false),
+		physical_order(false),
+		huge_pages(false)
 	{ }
 };
 
-void do_collect(const options &o, const char *progname)
+bool do_collect(const options &o, const char *progname)
 {
 	talk talker(o, progname);
 	fnmatch_filter fm(o.ignored_dirs);
-	collector c(o.min_size, 1, fm, o.exact, o.chmod_clear, o.debug,
-			o.progress, talker);
+	collector c(o.min_size, 1, o.prehash_size * off_t(1024), o.hash,
+			o.cache, o.io, o.drop_cache, fm, o.exact,
+			o.chmod_clear, o.debug, o.progress, max(o.threads, 1),
+			max(o.device_reads, 0), o.uring, o.inode_order,
+			o.physical_order, o.reflink, o.huge_pages, talker);
+	string why;
+	if (!o.journal.empty() && !o.hard_link) {
+		talker.warning("--journal needs --hard-link");
+		return false;
+	}
+	if (!o.journal.empty() && !c.keep_journal(o.journal, why)) {
+		talker.warning("Can't keep journal '%s': %s",
+				o.journal.c_str(), why.c_str());
+		return false;
+	}
 	talker.info("Collecting '%s' (minimum size %zd)",
 			o.path.c_str(), o.min_size);
+	talker.info("Hash: %s, checksum kernel: %s, I/O: %s",
+			o.hash.c_str(), checksum_kernels::best().name,
+			o.io.c_str());
 	c.collect(o.path.c_str());
+	c.show_memory_statistics();
+
+	collector::link_mode mode = o.reflink ? collector::reflinks :
+		o.hard_link ? collector::hard_links : collector::no_links;
+
+	if (o.stream)
+		c.start_streaming(o.dump, mode);
 	talker.info("Checking");
 	c.check();
 	talker.info("Ignored dirs: %zd", c.get_ignored_dir_count());
-	if (o.dump) {
+	if (o.stream) {
+		c.finish_streaming();
+	} else if (o.dump && mode != collector::reflinks) {
 		c.dump_duplicates();
 	}
+	// What sharing blocks saves is only known once it is done.
+	if (!o.stream && mode == collector::reflinks)
+		c.link_duplicates(mode, o.dump);
 	talker.info("Bytes saveable: %zd", c.get_saveable_space());
-	if (o.hard_link) {
-		c.hard_link_duplicates();
+	if (!o.stream && mode == collector::hard_links)
+		c.link_duplicates(mode, false);
+	return true;
+}
+
+// Finishes the hard links planned in the journal at path by a run that
+// was interrupted.
+bool do_resume(const options &o, const char *progname, const string &path)
+{
+	talk talker(o, progname);
+	link_journal j(path);
+	vector<link_journal::group> unfinished;
+	tick_counter ticks;
+	string why;
+
+	if (!j.resume(unfinished, why)) {
+		talker.warning("Can't resume from journal '%s': %s",
+				path.c_str(), why.c_str());
+		return false;
+	}
+
+	talker.info("Resuming %zu groups of links from '%s'",
+			unfinished.size(), path.c_str());
+	for (auto &g: unfinished)
+		j.finish(g, o.chmod_clear, true, ticks, talker);
+	return true;
+}
+
+// Hashes n bytes at p with engine for half a second and prints the
+// throughput.  Sets h to the digest and returns false if it changed
+// with the size of the pieces the data was fed in.
+static bool benchmark_engine(const char *name, hash_engine *engine,
+		uint64_t *p, size_t n, digest &h)
+{
+	checksummer c(engine);
+	time_value t0, t1;
+	int passes = 0;
+	bool ok = true;
+
+	// Pieces of 320 bytes make blocks straddle the pieces.
+	h = c.checksum(p, n, 320);
+
+	t0.now();
+	do {
+		if (c.checksum(p, n, n) != h)
+			ok = false;
+		passes ++;
+		t1.now();
+	} while (t1.microseconds() - t0.microseconds() < 500000);
+
+	double us = t1.microseconds() - t0.microseconds();
+	fmt::pf("%-8s %8.2f GB/s  %s%s\n", name,
+			double(n) * passes / us / 1e3, h.hex().c_str(),
+			ok ? "" : "  UNSTABLE");
+	return ok;
+}
+
+// Times each checksum kernel and hash engine on mib MiB of pseudo-random
+// data, and checks that the kernels all agree on the digest.
+static bool benchmark_checksum(int mib)
+{
+	size_t n = size_t(max(mib, 1)) << 20;
+	vector<uint64_t> buffer(n / sizeof(uint64_t));
+	lcg g(1);
+	bool ok = true;
+	digest reference, h;
+
+	for (auto &w: buffer) {
+		w = g.get();
+		w = (w << 32) | g.get();
+	}
+
+	for (auto &e: checksum_kernels::supported()) {
+		ok &= benchmark_engine(e.name, new lane_hash(1, e.k),
+				buffer.data(), n, h);
+		if (e.k == checksum_kernels::scalar) {
+			reference = h;
+		} else if (h != reference) {
+			fmt::pf("%s: MISMATCH\n", e.name);
+			ok = false;
+		}
 	}
+
+	ok &= benchmark_engine("fast128", new lane_hash(2),
+			buffer.data(), n, h);
+	ok &= benchmark_engine("blake3", new blake3_hash(),
+			buffer.data(), n, h);
+
+	// The digest of the empty input is known.
+	if (blake3_hash().result().hex() != "af1349b9f5f9a1a6a0404dea36dcc949"
+			"9bcb25c9adc112b7cc9a93cae41f3262") {
+		fmt::pf("blake3: WRONG\n");
+		ok = false;
+	}
+
+	return ok;
 }
 
 static const char *description =
@@ -1536,6 +6162,7 @@ int main(int argc, const char * const * argv)
 	int rc = 0;
 	options o;
 	string u;
+	int mib;
 
 	arguments args(argc, argv, description);
 
@@ -1560,10 +6187,65 @@ int main(int argc, const char * const * argv)
 			args.pop_int(o.min_size) &&
 			args.run("Ignore files smaller than this (bytes)")
 		) ||
+		(
+		 	args.pop_keyword("-p", "--prehash") &&
+			args.pop_int(o.prehash_size) &&
+			args.run("Pre-hash the first and last KiB of "
+				"candidates (64 by default, 0 to disable)")
+		) ||
+		(
+		 	args.pop_keyword("--hash") &&
+			args.pop_choice("name", hash_names, o.hash) &&
+			args.run("Hash files with fast64 (the default), "
+				"fast128 or blake3, which needs no comparison")
+		) ||
+		(
+		 	args.pop_keyword("--cache") &&
+			args.pop_string("file", o.cache) &&
+			args.run("Keep digests in this file from one run to "
+				"the next")
+		) ||
+		(
+		 	args.pop_keyword("--io") &&
+			args.pop_choice("mode", io_modes, o.io) &&
+			args.run("Read files with read (the default), map "
+				"them with mmap or read them with O_DIRECT")
+		) ||
+		(
+		 	args.pop_keyword("--drop-cache") &&
+			args.run("Drop the pages of files from the page cache "
+				"once they are checked") &&
+			(o.drop_cache = true, true)
+		) ||
 		(
 		 	args.pop_keyword("-H", "--hard-link") &&
 			args.run("De-duplicate files by creating hard links") &&
-			(o.hard_link = true, true)
+			(o.hard_link = true, o.reflink = false, true)
+		) ||
+		(
+		 	args.pop_keyword("--reflink") &&
+			args.run("De-duplicate files by sharing their blocks "
+				"through FIDEDUPERANGE") &&
+			(o.reflink = true, o.hard_link = false, true)
+		) ||
+		(
+		 	args.pop_keyword("--stream") &&
+			args.run("Dump and link duplicates as soon as they are "
+				"found, while checking goes on") &&
+			(o.stream = true, true)
+		) ||
+		(
+		 	args.pop_keyword("--journal") &&
+			args.pop_string("file", o.journal) &&
+			args.run("Plan hard links in this file before making "
+				"them, for --resume")
+		) ||
+		(
+		 	args.pop_keyword("--resume") &&
+			args.pop_string("file", u) &&
+			args.run("Finish the hard links planned in this "
+				"journal by an interrupted run") &&
+			(rc = do_resume(o, argv[0], u) ? 0 : 1, true)
 		) ||
 		(
 		 	args.pop_keyword("-d", "--dump") &&
@@ -1586,6 +6268,48 @@ int main(int argc, const char * const * argv)
 			args.run("Clear mode bits from deduplicated files "
 				"(0222 by default)")
 		) ||
+		(
+		 	args.pop_keyword("-j", "--threads") &&
+			args.pop_int(o.threads) &&
+			args.run("Scan directories and check files using this "
+				"many threads (1 by default)")
+		) ||
+		(
+		 	args.pop_keyword("--device-reads") &&
+			args.pop_int(o.device_reads) &&
+			args.run("Read at most this many files per device at "
+				"once (by default, 1 on spinning disks)")
+		) ||
+		(
+		 	args.pop_keyword("-U", "--io-uring") &&
+			args.run("Stat directory entries in batches through "
+				"io_uring") &&
+			(o.uring = true, true)
+		) ||
+		(
+		 	args.pop_keyword("-n", "--inode-order") &&
+			args.run("Stat directory entries in inode order") &&
+			(o.inode_order = true, true)
+		) ||
+		(
+		 	args.pop_keyword("--physical-order") &&
+			args.run("Check files in the order of their location "
+				"on disk") &&
+			(o.physical_order = true, true)
+		) ||
+		(
+		 	args.pop_keyword("--huge-pages") &&
+			args.run("Keep file names in memory backed by huge "
+				"pages") &&
+			(o.huge_pages = true, true)
+		) ||
+		(
+		 	args.pop_keyword("--benchmark-checksum") &&
+			args.pop_int(mib) &&
+			args.run("Measure the throughput of each checksum "
+				"kernel on this many MiB of memory") &&
+			(rc = benchmark_checksum(mib) ? 0 : 1, true)
+		) ||
 		(
 		 	args.pop_keyword("-W", "-no-warnings") &&
 			args.run("Disable warning messages") &&
@@ -1610,7 +6334,7 @@ int main(int argc, const char * const * argv)
 			args.pop_string("path", o.path) &&
 			args.run("Scan files under <path>") &&
 			args.is_empty() &&
-			(do_collect(o, argv[0]), true)
+			(rc = do_collect(o, argv[0]) ? 0 : 1, true)
 		) ||
 		args.error();
 	} while (!args.is_empty() || args.processing());
@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# Measures the comparison throughput on a set of identical large files,
+# every byte of which is read.  With two files, the pair is compared
+# directly; with more, they are hashed first.  Each run is made with
+# --io read, mmap and direct, on a warm page cache and, when run as root,
+# on a cold one.
+#
+# Usage: bench-compare.sh [MiB] [files] [extra fhlink options...]
+#
+# Set FHLINK to the binary to measure another build.
+
+set -e
+
+size="${1:-256}"
+n_files="${2:-2}"
+shift 2 || true
+
+fhlink="${FHLINK:-../src/fhlink}"
+dir="/tmp/bench-compare-$$.$RANDOM"
+
+echo "$0: Generating $n_files files of $size MiB under $dir"
+mkdir -p "$dir"
+head -c $(( size << 20 )) /dev/urandom >"$dir/f.1"
+for i in `seq 2 $n_files` ; do
+        cp "$dir/f.1" "$dir/f.$i"
+done
+
+can_drop=no
+if [ -w /proc/sys/vm/drop_caches ] ; then
+        can_drop=yes
+fi
+
+run()
+{
+        local cache="$1" io="$2" t0 t1
+        shift 2
+        if [ $cache = cold ] ; then
+                sync
+                echo 3 >/proc/sys/vm/drop_caches
+        fi
+        t0=$(date +%s.%N)
+        "$fhlink" --no-progress --no-information --io $io "$@" "$dir" \
+                >/dev/null
+        t1=$(date +%s.%N)
+        echo "$t0 $t1" | awk -v n=$(( n_files * size )) \
+                -v what="$io $cache" \
+                '{ t = $2 - $1; printf "%-10s %8.3f s %10.1f MiB/s\n", what, t, n / t }'
+}
+
+for pass in 1 2 3 ; do
+        for io in read mmap direct ; do
+                if [ $can_drop = yes ] ; then
+                        run cold $io "$@"
+                fi
+                run warm $io "$@"
+        done
+done
+
+rm -rf "$dir"
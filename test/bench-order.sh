@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Compares checking a tree in size order and with --physical-order.  The
+# generated tree has pairs of identical files written in random order, so
+# that their sizes have nothing to do with their location on disk.  When
+# run as root, the page cache is dropped before each run so that the
+# timings are for a cold cache.
+#
+# Usage: bench-order.sh [pairs] [KiB] [extra fhlink options...]
+#
+# Set FHLINK to the binary to measure another build.
+
+set -e
+
+n_pairs="${1:-1000}"
+kib="${2:-256}"
+shift 2 || true
+
+fhlink="${FHLINK:-../src/fhlink}"
+dir="/tmp/bench-order-$$.$RANDOM"
+
+echo "$0: Generating $n_pairs pairs of files of about $kib KiB under $dir"
+mkdir -p "$dir"
+head -c $(( 2 * kib * 1024 )) /dev/urandom >"$dir/.data"
+for i in `seq 1 $n_pairs` ; do
+        echo $i
+        echo $i
+done | shuf | while read i ; do
+        f="$dir/f.$i.a"
+        [ -e "$f" ] && f="$dir/f.$i.b"
+        head -c $(( kib * 1024 + i )) "$dir/.data" >"$f"
+done
+rm "$dir/.data"
+sync
+
+cache=warm
+if [ -w /proc/sys/vm/drop_caches ] ; then
+        cache=cold
+fi
+
+run()
+{
+        local what="$1" t0 t1
+        shift
+        if [ $cache = cold ] ; then
+                echo 3 >/proc/sys/vm/drop_caches
+        fi
+        t0=$(date +%s.%N)
+        "$fhlink" --no-progress "$@" "$dir" 2>&1 >/dev/null |
+                grep -E 'Seek distance' | sed 's/^.*: /  /' || true
+        t1=$(date +%s.%N)
+        echo "$t0 $t1" | awk -v what="$what $cache" \
+                '{ printf "%-20s %8.3f s\n", what, $2 - $1 }'
+}
+
+for pass in 1 2 3 ; do
+        run size-order "$@"
+        run physical-order --physical-order "$@"
+done
+
+rm -rf "$dir"
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Compares directory scanning speeds on a generated tree of small files:
+# synchronous stat in readdir order, in inode order, and through io_uring.
+# When run as root, the page cache is dropped before each run so that
+# the timings are for a cold cache.
+#
+# Usage: bench-scan.sh [dirs] [files-per-dir] [extra fhlink options...]
+
+set -e
+
+n_dirs="${1:-200}"
+n_files="${2:-200}"
+shift 2 || true
+
+dir="/tmp/bench-scan-$$.$RANDOM"
+
+echo "$0: Generating $n_dirs x $n_files files under $dir"
+for d in `seq 1 $n_dirs` ; do
+        mkdir -p "$dir/d.$(( d % 16 ))/d.$d"
+        ( cd "$dir/d.$(( d % 16 ))/d.$d" && seq 1 $n_files | xargs touch )
+done
+entries=$(find "$dir" | wc -l)
+
+cache=warm
+if [ -w /proc/sys/vm/drop_caches ] ; then
+        cache=cold
+fi
+
+run()
+{
+        local what="$1" t0 t1
+        shift
+        if [ $cache = cold ] ; then
+                sync
+                echo 3 >/proc/sys/vm/drop_caches
+        fi
+        t0=$(date +%s.%N)
+        ../src/fhlink --no-progress --no-information --min-size 1000000000 \
+                "$@" "$dir"
+        t1=$(date +%s.%N)
+        echo "$t0 $t1" | awk -v n="$entries" -v what="$what $cache" \
+                '{ t = $2 - $1; printf "%-18s %8.3f s %12.0f entries/s\n", what, t, n / t }'
+}
+
+for pass in 1 2 ; do
+        run sync "$@"
+        run inode-order --inode-order "$@"
+        run io_uring --io-uring "$@"
+done
+
+rm -rf "$dir"
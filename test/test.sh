@@ -11,9 +11,121 @@ if [ -e "$dir" ]; then
         exit 1
 fi
 
+if ! ../src/fhlink --benchmark-checksum 1 ; then
+        echo "$0: TEST FAILED! (checksum kernels disagree)" 2>&1
+        exit 4
+fi
+
 ./mktestdir.sh "$dir"
 du -s "$dir" >"$dir.before.size"
 find "$dir" -type f -print0 | xargs -0 md5sum|sort >"$dir.before"
+../src/fhlink --dump --min-size 1 "$dir" >"$dir.dump.serial"
+../src/fhlink --dump --min-size 1 --threads 4 "$dir" >"$dir.dump.threads"
+if ! cmp -s "$dir.dump.serial" "$dir.dump.threads" ; then
+        echo "$0: TEST FAILED! (--threads changes the duplicates)" 2>&1
+        exit 3
+fi
+../src/fhlink --dump --min-size 1 --threads 4 --stream "$dir" \
+        >"$dir.dump.stream"
+if ! cmp -s "$dir.dump.serial" "$dir.dump.stream" ; then
+        echo "$0: TEST FAILED! (--stream changes the duplicates)" 2>&1
+        exit 3
+fi
+for io in mmap direct ; do
+        ../src/fhlink --dump --min-size 1 --io $io --drop-cache "$dir" \
+                >"$dir.dump.$io"
+        if ! cmp -s "$dir.dump.serial" "$dir.dump.$io" ; then
+                echo "$0: TEST FAILED! (--io $io changes the duplicates)" 2>&1
+                exit 3
+        fi
+done
+for hash in fast128 blake3 ; do
+        ../src/fhlink --dump --min-size 1 --hash $hash "$dir" |
+                tr ' ' '\n' | sort >"$dir.dump.$hash"
+        tr ' ' '\n' <"$dir.dump.serial" | sort >"$dir.dump.sorted"
+        if ! cmp -s "$dir.dump.sorted" "$dir.dump.$hash" ; then
+                echo "$0: TEST FAILED! (--hash $hash changes the duplicates)" 2>&1
+                exit 3
+        fi
+done
+# A cached digest must not outlive a change to its file
+../src/fhlink --dump --min-size 1 --hash blake3 --cache "$dir.cache" "$dir" \
+        >"$dir.dump.cache"
+tr ' ' '\n' <"$dir.dump.cache" | sort >"$dir.dump.cache.sorted"
+if ! cmp -s "$dir.dump.sorted" "$dir.dump.cache.sorted" ; then
+        echo "$0: TEST FAILED! (--cache changes the duplicates)" 2>&1
+        exit 3
+fi
+changed="$(awk 'NR == 1 { print $4 }' "$dir.dump.cache" | tr -d "'")"
+cp -p "$changed" "$dir.saved"
+printf X | dd of="$changed" bs=1 seek=10 conv=notrunc 2>/dev/null
+printf Y | dd of="$changed" bs=1 seek=11 conv=notrunc 2>/dev/null
+../src/fhlink --dump --min-size 1 --hash blake3 --cache "$dir.cache" "$dir" \
+        >"$dir.dump.cache"
+if grep -q "'$changed'" "$dir.dump.cache" ; then
+        echo "$0: TEST FAILED! (--cache returns a stale digest)" 2>&1
+        exit 3
+fi
+cp -p "$dir.saved" "$changed"
+rm -f "$dir.saved" "$dir.cache"
+
+# Files larger than a leaf are hashed as a tree, in parallel
+mkdir "$dir.big"
+yes fhlink | head -c 9437184 >"$dir.big/a"
+cp "$dir.big/a" "$dir.big/b"
+cp "$dir.big/a" "$dir.big/c"
+printf X | dd of="$dir.big/c" bs=1 seek=4718592 conv=notrunc 2>/dev/null
+for hash in fast64 blake3 ; do
+        for io in read mmap direct ; do
+                ../src/fhlink --dump --min-size 1 --threads 4 \
+                        --device-reads 4 --hash $hash --io $io \
+                        "$dir.big" >"$dir.dump.big"
+                if [ "$(grep -c "^duplicates .*/a'" "$dir.dump.big")" != 1 ] ||
+                        grep -q "/c'" "$dir.dump.big" ; then
+                        echo "$0: TEST FAILED! (tree hash with --hash $hash --io $io)" 2>&1
+                        exit 3
+                fi
+        done
+done
+rm -rf "$dir.big"
+# Sharing blocks, or failing to where the file system can't, must leave
+# every file with its contents
+../src/fhlink --reflink --min-size 1 "$dir" >/dev/null 2>&1
+find "$dir" -type f -print0 | xargs -0 md5sum|sort >"$dir.reflinked"
+if ! cmp -s "$dir.before" "$dir.reflinked" ; then
+        echo "$0: TEST FAILED! (--reflink changes files)" 2>&1
+        exit 3
+fi
+# --resume finishes a run killed after planning its groups and before
+# replacing any target.  That state is rebuilt by keeping a second name of
+# every file outside the tree, putting the files back from them after a
+# run, and cutting the done records of its two groups off the journal.
+j="$dir.j"
+mkdir -p "$j/a" "$j/b" "$j/c" "$j.keep"
+yes x | head -c 200000 >"$j/a/x"
+cp "$j/a/x" "$j/b/x"
+cp "$j/a/x" "$j/b/y"
+yes u | head -c 200000 >"$j/c/u"
+cp "$j/c/u" "$j/c/v"
+names="a/x b/x b/y c/u c/v"
+for f in $names ; do ln "$j/$f" "$j.keep/${f/\//_}" ; done
+../src/fhlink --dump --hard-link --journal "$dir.journal" "$j" \
+        >"$dir.dump.j" 2>/dev/null
+for f in $names ; do ln -f "$j.keep/${f/\//_}" "$j/$f" ; done
+truncate -s -48 "$dir.journal"
+# A temporary name left linked to the source, and a file that changed
+source="$(grep "/b/y'" "$dir.dump.j" | awk '{ print $4 }' | tr -d "'")"
+ln "$source" "$j/b/.fhlink.1.1"
+printf X >>"$j/c/v"
+../src/fhlink --resume "$dir.journal" 2>/dev/null
+if [ "$(stat -c %i "$j/a/x" "$j/b/x" "$j/b/y" | sort -u | wc -l)" != 1 ] ||
+        [ "$(stat -c %h "$j/b/y")" != 4 ] ||
+        [ -n "$(find "$j" -name '.fhlink.*')" ] ||
+        [ "$(stat -c %i "$j/c/u")" = "$(stat -c %i "$j/c/v")" ] ; then
+        echo "$0: TEST FAILED! (--resume)" 2>&1
+        exit 3
+fi
+rm -rf "$j" "$j.keep" "$dir.journal" "$dir.dump.j"
 ../src/fhlink --dump --hard-link --chmod-clear 0222 "$dir" >"$dir.dump"
 find "$dir" -type f -print0 | xargs -0 md5sum|sort >"$dir.after"
 du -s "$dir" >"$dir.after.size"